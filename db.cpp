@@ -1,13 +1,31 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 using namespace std;
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
@@ -25,18 +43,32 @@ const uint16_t EMAIL_LENGTH = 255;
 /*
 *   Table and Page size
 */
-const uint16_t PAGE_SIZE = 4 * 1024; // 4KB
+// The page size is chosen when the database is created and is stored in the
+// file header, so an existing database always reopens with its own page size.
+const uint32_t DEFAULT_PAGE_SIZE = 4 * 1024; // 4KB
+const uint32_t MIN_PAGE_SIZE = 4 * 1024; // 4KB
+const uint32_t MAX_PAGE_SIZE = 64 * 1024; // 64KB
 const uint16_t TABLE_MAX_PAGES = 100;
 
+// Huge pages are 2MB on the platforms we care about, a MAP_HUGETLB mapping
+// has to be a multiple of this.
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
 /// @brief Represents the state of the meta command
 enum MetaCommandResult {
     META_COMMAND_SUCCESS,
+    META_COMMAND_FAILURE, // the command ran and wrote out why it failed
+    META_COMMAND_EXIT,
     META_COMMAND_UNRECOGNIZED
 };
 
 enum ExecuteResult {
     EXECUTE_SUCCESS,
     EXECUTE_TABLE_FULL,
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_TRANSACTION_ACTIVE,
+    EXECUTE_NO_TRANSACTION,
+    EXECUTE_LOCKED,
     EXECUTE_FAILURE
 };
 
@@ -45,6 +77,9 @@ enum StatementCommand {
     STATEMENT_SELECT,
     STATEMENT_INSERT,
     STATEMENT_DELETE,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_ROLLBACK,
     STATEMENT_UNRECOGNIZED
 };
 
@@ -58,6 +93,13 @@ enum StatementPrepareState {
     PREPARE_UNRECOGNIZED
 };
 
+/// @brief Represents the outcome of running one line of input, see process_input.
+enum ProcessInputResult {
+    PROCESS_INPUT_SUCCESS,
+    PROCESS_INPUT_FAILURE, // rejected, or its statement or meta command failed
+    PROCESS_INPUT_EXIT
+};
+
 /// @brief Represents the outcome of reading input from console.
 enum InputResult {
     SUCCESS,
@@ -71,6 +113,12 @@ enum NodeType {
     LEAF
 };
 
+/// @brief Storage engine of the table, chosen when the database is created.
+enum StorageEngine {
+    ENGINE_BTREE, // rows are inserted in place into the B+ tree
+    ENGINE_LSM // rows are buffered in memory and written out as sorted runs
+};
+
 
 
 /// @brief Console Input representation
@@ -85,33 +133,207 @@ struct Row {
     char email[EMAIL_LENGTH + 1]; // +1 for null terminator
 };
 
+/// @brief Parsed form of:
+/// select [count(*)] [where id between <start> and <end>] [limit <n>] [offset <m>]
+struct SelectQuery {
+    bool count = false;
+    bool has_range = false;
+    uint32_t range_start = 0;
+    uint32_t range_end = 0;
+    uint32_t limit = UINT32_MAX;
+    uint32_t offset = 0;
+};
+
 struct Statement {
     StatementCommand statement_command;
     Row row;
+    SelectQuery select;
+};
+
+/// @brief Options given on the command line, the storage related ones are
+/// only honoured when a new database file is created.
+struct DbOptions {
+    string filename;
+    uint32_t page_size = DEFAULT_PAGE_SIZE;
+    bool direct_io = false; // bypass the kernel page cache with O_DIRECT
+    bool huge_pages = false; // back the page arena with huge pages
+    bool compress = false; // compress the pages of a new database on disk
+    StorageEngine engine = ENGINE_BTREE;
+    string serve_path; // serve clients on this unix socket instead of the repl
+    string record_path; // log every input line to this trace file
+    string replay_path; // run the inputs of this trace file instead of the repl
+    bool replay_paced = false; // replay at the pace the trace was recorded at
+};
+
+/// @brief Bloom filter over the keys of a sorted run, a point lookup only
+/// reads the run's pages if the filter says the key may be there.
+struct BloomFilter {
+    vector<uint64_t> bits;
+};
+
+/// @brief An immutable sorted run of the LSM engine. On disk, a run is a chain
+/// of full leaf pages in the usual leaf format. The page list, the first key
+/// of every page (fences) and the bloom filter are rebuilt in memory on open.
+struct LsmRun {
+    uint32_t id; // in memory only, to tell the runs apart across compactions
+    uint32_t num_rows;
+    uint32_t min_key;
+    uint32_t max_key;
+    vector<uint32_t> pages;
+    vector<uint32_t> page_min_keys;
+    BloomFilter bloom;
+};
+
+/// @brief A consistent read only view of the database as of the time it was
+/// taken. The first time a page is modified while a snapshot is open, the
+/// writer copies the old image of the page aside for the snapshot and then
+/// updates the live page in place. Snapshot reads use the preserved image if
+/// there is one and the live page otherwise.
+/// Selects and .backup read through a snapshot, they only take the table lock
+/// to copy a page out and do not hold off the writers while they scan.
+struct Snapshot {
+    uint32_t root_page_num;
+    uint32_t num_pages; // pages allocated after the snapshot are not part of it
+
+    // LSM engine: the runs and the memtable change in memory, not in pages,
+    // the snapshot has its own copy of them
+    vector<LsmRun> lsm_runs;
+    map<uint32_t, vector<char>> lsm_memtable;
+
+    // Old page images, shared by all the snapshots that were open when the
+    // page was modified and freed once the last of them is released.
+    map<uint32_t, shared_ptr<vector<char>>> page_images;
+};
+
+/// @brief I/O counters of the pager, reported by --replay.
+struct PagerStats {
+    uint64_t page_hits;     // get_page found the page in the cache
+    uint64_t page_misses;   // get_page had to load the page
+    uint64_t bytes_read;    // read from the database file on a miss
+    uint64_t pages_written;
+    uint64_t bytes_written; // to the database file, journal excluded
+    uint64_t journal_bytes;
+    uint64_t syncs;         // fsync/fdatasync of the journal and the database
+};
+
+/// @brief Where a page of a compressed database is stored in the file.
+struct PageExtent {
+    uint32_t offset;
+    uint32_t length; // 0 if the page was never written
 };
 
 struct Pager {
     int file_descriptor;
     uint32_t file_length;
     uint32_t num_pages;
+    uint32_t page_size;
+    bool direct_io;
+
+    // All the page frames are carved out of a single page aligned arena,
+    // frame i always caches page i.
+    void* arena;
+    size_t arena_size;
     
     // cache of pages in memory
     void* pages[TABLE_MAX_PAGES];
+
+    // pages modified since they were last written to the file
+    bool dirty[TABLE_MAX_PAGES];
+
+    // Compressed database: the pages (except the header) are compressed when
+    // they are written and stored in variable size extents, see commit_pages.
+    // The cached pages are always uncompressed.
+    bool compressed;
+    PageExtent extents[TABLE_MAX_PAGES];
+
+    PagerStats stats;
+
+    // open snapshots, the writers preserve the old page images for them
+    vector<Snapshot*> snapshots;
+
+    // Open transaction: the image every page had at begin, saved the first
+    // time the transaction modifies it. Pages from transaction_num_pages
+    // onwards were added by the transaction and are dropped on rollback.
+    bool in_transaction;
+    uint32_t transaction_num_pages;
+    map<uint32_t, vector<char>> before_images;
+};
+
+struct LsmTree {
+    // Rows that are not in any run yet, in their on disk (row) format
+    map<uint32_t, vector<char>> memtable;
+    vector<LsmRun> runs;
+    uint32_t next_run_id = 0;
+
+    // Pages of the runs dropped by compaction, reused by later runs
+    vector<uint32_t> free_pages;
+
+    // the memtable as it was when the open transaction began
+    map<uint32_t, vector<char>> transaction_memtable;
+
+    thread compaction_worker;
+    bool compaction_running = false;
+    // bumped on rollback, a compaction that started before is discarded
+    uint32_t generation = 0;
+};
+
+/// @brief Writes the trace of --record. The server workers record
+/// concurrently, so the records are appended under a lock.
+struct TraceRecorder {
+    int fd;
+    mutex lock;
+    chrono::steady_clock::time_point last_time;
+    string buffer; // written out once TRACE_BUFFER_SIZE fills up, and on close
 };
 
 struct Table {
+    string filename;
     Pager pager;
-    uint32_t num_rows;
+    StorageEngine engine;
     uint32_t root_page_num;
+    LsmTree lsm;
+
+    // Guards the table and its pager, statements hold it while executing and
+    // background readers (eg backup) only take it to copy a page out.
+    unique_ptr<mutex> lock;
+
+    // the session that began the open transaction, see execute_statement
+    uint32_t transaction_session;
+
+    // Guards backup_worker, server sessions can start backups concurrently.
+    // Never taken while holding lock, the backup takes lock to copy pages.
+    unique_ptr<mutex> backup_lock;
+    thread backup_worker;
+
+    // every input line run against the table is logged here with --record
+    unique_ptr<TraceRecorder> trace;
 };
 
+// Session of the interactive repl, the server numbers its clients from 1
+const uint32_t REPL_SESSION_ID = 0;
+
 struct Cursor {
     Table* table;
     uint32_t page_num; // 0 indexed
     uint32_t cell_num; // 0 indexed
     bool end_of_table; // whether the cursor is at the end of table.
+
+    // LSM engine: the cursor merges a leaf cursor per sorted run and the
+    // memtable, it is positioned at whichever of them has the smallest key.
+    vector<Cursor> run_cursors;
+    map<uint32_t, vector<char>>::iterator memtable_it;
+    int32_t source;
+
+    // Set if the cursor reads a snapshot, it keeps a copy of the page it is
+    // at instead of pointing into the page cache, see get_cursor_page.
+    Snapshot* snapshot = nullptr;
+    uint32_t snapshot_page_num = 0;
+    vector<char> snapshot_page;
 };
 
+const int32_t LSM_SOURCE_NONE = -2;
+const int32_t LSM_SOURCE_MEMTABLE = -1;
+
 /*
  *   Row layout related
  */
@@ -126,8 +348,109 @@ const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 /*
  * Storage related constants
  */
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = TABLE_MAX_PAGES * ROWS_PER_PAGE;
+uint32_t rows_per_page(uint32_t page_size) {
+    return page_size / ROW_SIZE;
+}
+
+uint32_t table_max_rows(uint32_t page_size) {
+    return TABLE_MAX_PAGES * rows_per_page(page_size);
+}
+
+/*
+ * @brief Database Header Metadata
+ */
+///////////// Database Header Layout //////////////
+// Page 0 of the file is reserved for the database header, it describes how
+// the rest of the file is laid out. The header is always read with the
+// smallest page size, so it has to fit in MIN_PAGE_SIZE.
+
+// MAGIC(16 bytes) | PAGE_SIZE(4 bytes) | ROOT_PAGE_NUM(4 bytes) | ENGINE(4 bytes) |
+// LSM_NUM_RUNS(4 bytes) | LSM_RUN_0 | ... | LSM_RUN_(LSM_MAX_RUNS - 1) |
+// COMPRESSED(4 bytes) | PAGE_MAP_0 | ... | PAGE_MAP_(TABLE_MAX_PAGES - 1)
+const char DB_HEADER_MAGIC[] = "flatDB format 3";
+const uint32_t DB_HEADER_MAGIC_SIZE = sizeof(DB_HEADER_MAGIC);
+const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+const uint32_t DB_HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_PAGE_SIZE_OFFSET =
+    DB_HEADER_MAGIC_OFFSET + DB_HEADER_MAGIC_SIZE;
+const uint32_t DB_HEADER_ROOT_PAGE_NUM_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_ROOT_PAGE_NUM_OFFSET =
+    DB_HEADER_PAGE_SIZE_OFFSET + DB_HEADER_PAGE_SIZE_SIZE;
+const uint32_t DB_HEADER_ENGINE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_ENGINE_OFFSET =
+    DB_HEADER_ROOT_PAGE_NUM_OFFSET + DB_HEADER_ROOT_PAGE_NUM_SIZE;
+const uint32_t DB_HEADER_LSM_NUM_RUNS_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_LSM_NUM_RUNS_OFFSET =
+    DB_HEADER_ENGINE_OFFSET + DB_HEADER_ENGINE_SIZE;
+const uint32_t DB_HEADER_LSM_RUNS_OFFSET =
+    DB_HEADER_LSM_NUM_RUNS_OFFSET + DB_HEADER_LSM_NUM_RUNS_SIZE;
+
+// LSM_RUN: FIRST_PAGE(4 bytes) | NUM_ROWS(4 bytes) | MIN_KEY(4 bytes) | MAX_KEY(4 bytes)
+const uint32_t LSM_RUN_FIRST_PAGE_OFFSET = 0;
+const uint32_t LSM_RUN_NUM_ROWS_OFFSET = LSM_RUN_FIRST_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t LSM_RUN_MIN_KEY_OFFSET = LSM_RUN_NUM_ROWS_OFFSET + sizeof(uint32_t);
+const uint32_t LSM_RUN_MAX_KEY_OFFSET = LSM_RUN_MIN_KEY_OFFSET + sizeof(uint32_t);
+const uint32_t LSM_RUN_SIZE = LSM_RUN_MAX_KEY_OFFSET + sizeof(uint32_t);
+const uint32_t LSM_MAX_RUNS = 16;
+
+const uint32_t DB_HEADER_COMPRESSED_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_COMPRESSED_OFFSET =
+    DB_HEADER_LSM_RUNS_OFFSET + LSM_MAX_RUNS * LSM_RUN_SIZE;
+const uint32_t DB_HEADER_PAGE_MAP_OFFSET =
+    DB_HEADER_COMPRESSED_OFFSET + DB_HEADER_COMPRESSED_SIZE;
+
+// PAGE_MAP: OFFSET(4 bytes) | LENGTH(4 bytes), where page i is stored in a
+// compressed database. Length 0 is a page that was never written, and a page
+// that does not compress is stored as is, with length PAGE_SIZE.
+const uint32_t PAGE_MAP_OFFSET_OFFSET = 0;
+const uint32_t PAGE_MAP_LENGTH_OFFSET = PAGE_MAP_OFFSET_OFFSET + sizeof(uint32_t);
+const uint32_t PAGE_MAP_ENTRY_SIZE = PAGE_MAP_LENGTH_OFFSET + sizeof(uint32_t);
+
+const uint32_t DB_HEADER_SIZE =
+    DB_HEADER_PAGE_MAP_OFFSET + TABLE_MAX_PAGES * PAGE_MAP_ENTRY_SIZE;
+const uint32_t DB_HEADER_PAGE_NUM = 0;
+
+///////////// Rollback Journal Layout //////////////
+// A commit first saves the file contents it is about to overwrite to
+// <db file>-journal, a journal left behind by a crash is played back on open.
+
+// MAGIC(16 bytes) | PAGE_SIZE(4 bytes) | NUM_PAGES(4 bytes) | FILE_LENGTH(8 bytes)
+// followed by NUM_PAGES entries of PAGE_NUM(4 bytes) | PAGE(PAGE_SIZE bytes).
+// The header is written after the entries are synced, a journal without a
+// valid header was never complete and the database file was not touched.
+const char JOURNAL_MAGIC[] = "flatDB journal1";
+const uint32_t JOURNAL_MAGIC_SIZE = sizeof(JOURNAL_MAGIC);
+const uint32_t JOURNAL_MAGIC_OFFSET = 0;
+const uint32_t JOURNAL_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t JOURNAL_PAGE_SIZE_OFFSET = JOURNAL_MAGIC_OFFSET + JOURNAL_MAGIC_SIZE;
+const uint32_t JOURNAL_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t JOURNAL_NUM_PAGES_OFFSET = JOURNAL_PAGE_SIZE_OFFSET + JOURNAL_PAGE_SIZE_SIZE;
+const uint32_t JOURNAL_FILE_LENGTH_SIZE = sizeof(uint64_t);
+const uint32_t JOURNAL_FILE_LENGTH_OFFSET = JOURNAL_NUM_PAGES_OFFSET + JOURNAL_NUM_PAGES_SIZE;
+const uint32_t JOURNAL_HEADER_SIZE = JOURNAL_FILE_LENGTH_OFFSET + JOURNAL_FILE_LENGTH_SIZE;
+const uint32_t JOURNAL_PAGE_NUM_SIZE = sizeof(uint32_t);
+
+///////////// Trace File Layout //////////////
+// Written by --record and read by --replay: MAGIC(16 bytes) followed by one
+// record per input line, all the numbers are LEB128 varints.
+// TIME_DELTA(microseconds since the previous record) | SESSION_ID | LENGTH | LINE(LENGTH bytes)
+const char TRACE_MAGIC[] = "flatDB trace v1";
+const uint32_t TRACE_MAGIC_SIZE = sizeof(TRACE_MAGIC);
+const uint32_t TRACE_BUFFER_SIZE = 64 * 1024;
+
+/*
+ * LSM engine tuning
+ */
+// The memtable is written out as a run once it fills this many leaves
+const uint32_t LSM_MEMTABLE_PAGES = 4;
+// Compaction is size tiered: the runs of less than LSM_MEMTABLE_PAGES leaves
+// are tier 0, and every tier holds runs up to LSM_TIER_FANOUT times larger
+// than the one before. Once a tier has LSM_TIER_FANOUT runs, only those are
+// merged in the background, the result moves up a tier. A row is rewritten
+// about once per tier, rather than on every compaction.
+const uint32_t LSM_TIER_FANOUT = 4;
+const uint32_t BLOOM_BITS_PER_KEY = 10;
+const uint32_t BLOOM_NUM_HASHES = 7;
 
 /*
  * @brief B+ Tree Node Metadata 
@@ -137,25 +460,35 @@ const uint32_t TABLE_MAX_ROWS = TABLE_MAX_PAGES * ROWS_PER_PAGE;
 // will need extra metadata to manage the tree structure and the context for
 // each node. Each node will have a common header layout which will be used.
 
-// NODE_TYPE(1 byte) | IS_ROOT(1 byte) | PARENT_POINTER(4 bytes)
-const uint32_t NODE_TYPE_SIZE = sizeof(NodeType);
+// NODE_TYPE(1 byte) | IS_ROOT(1 byte) | PADDING(2 bytes) | PARENT_POINTER(4 bytes)
+// The accessors below dereference the 4 byte fields of the nodes in place,
+// the padding keeps all of them 4 byte aligned.
+const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 const uint32_t NODE_TYPE_OFFSET = 0;
 const uint32_t IS_ROOT_SIZE = sizeof(bool);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const uint32_t NODE_HEADER_PADDING_SIZE = 2;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const uint32_t PARENT_POINTER_OFFSET =
+    IS_ROOT_OFFSET + IS_ROOT_SIZE + NODE_HEADER_PADDING_SIZE;
 const uint32_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+    NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_HEADER_PADDING_SIZE + PARENT_POINTER_SIZE;
 
 //////////// Leaf Node Header Layout //////////////
 // A leaf node will also need to track how many cells are part of it.
 // An internal node in B+ tree doesnt store data so this is only required
-// for the leaf nodes.
+// for the leaf nodes. The leaves are chained left to right so that a scan
+// does not have to go back up the tree, 0 marks the last leaf (page 0 is
+// the database header so it can never be a leaf).
 
-// COMMON_HEADER + NUM_CELLS(4 bytes)
+// COMMON_HEADER + NUM_CELLS(4 bytes) + NEXT_LEAF(4 bytes)
 const uint32_t LEAF_NODE_NUM_CELLS = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS + LEAF_NODE_NEXT_LEAF_SIZE;
 
 //////////// Leaf Node Body Layout //////////////
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
@@ -163,29 +496,168 @@ const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET = 
     LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = 
-    LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = 
-    PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+// padded to a multiple of 4 bytes, so the key of every cell is aligned
+const uint32_t LEAF_NODE_CELL_SIZE =
+    (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE + 3) / 4 * 4;
+
+// The no. of cells depends on the page size the database was created with
+uint32_t leaf_node_space_for_cells(uint32_t page_size) {
+    return page_size - LEAF_NODE_HEADER_SIZE;
+}
+
+uint32_t leaf_node_max_cells(uint32_t page_size) {
+    return leaf_node_space_for_cells(page_size) / LEAF_NODE_CELL_SIZE;
+}
+
+// When a leaf splits, the existing cells and the new one are divided evenly
+// between the old (left) and the new (right) leaf.
+uint32_t leaf_node_right_split_count(uint32_t page_size) {
+    return (leaf_node_max_cells(page_size) + 1) / 2;
+}
+
+uint32_t leaf_node_left_split_count(uint32_t page_size) {
+    return (leaf_node_max_cells(page_size) + 1) - leaf_node_right_split_count(page_size);
+}
+
+//////////// Internal Node Header Layout //////////////
+// An internal node has one more child than keys, the right most child is
+// kept in the header. Along with every child pointer, the node also stores
+// the no. of rows in that child's subtree. This makes the tree an order
+// statistic tree: counting the rows in a key range or finding the row at a
+// given rank only needs a walk from the root to a leaf.
+
+// COMMON_HEADER + NUM_KEYS(4 bytes) + RIGHT_CHILD(4 bytes) + RIGHT_CHILD_ROW_COUNT(4 bytes)
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_ROW_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_ROW_COUNT_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+    INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE +
+    INTERNAL_NODE_RIGHT_CHILD_ROW_COUNT_SIZE;
+
+//////////// Internal Node Body Layout //////////////
+// Cell_i = CHILD(4 bytes) | CHILD_ROW_COUNT(4 bytes) | KEY(4 bytes)
+// KEY is the max key in the subtree of the child.
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CHILD_OFFSET = 0;
+const uint32_t INTERNAL_NODE_CHILD_ROW_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CHILD_ROW_COUNT_OFFSET =
+    INTERNAL_NODE_CHILD_OFFSET + INTERNAL_NODE_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_OFFSET =
+    INTERNAL_NODE_CHILD_ROW_COUNT_OFFSET + INTERNAL_NODE_CHILD_ROW_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE +
+    INTERNAL_NODE_CHILD_ROW_COUNT_SIZE + INTERNAL_NODE_KEY_SIZE;
+
+// NOTE: Even with the smallest page size an internal node has room for more
+// children than TABLE_MAX_PAGES, so an internal node never needs to split.
+uint32_t internal_node_max_cells(uint32_t page_size) {
+    return (page_size - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+}
+
+/*
+* Database header accessors
+*/
+uint32_t* get_db_header_page_size(void* header) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(header) + DB_HEADER_PAGE_SIZE_OFFSET);
+}
+
+uint32_t* get_db_header_root_page_num(void* header) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(header) + DB_HEADER_ROOT_PAGE_NUM_OFFSET);
+}
+
+bool is_db_header_valid(void* header) {
+    return memcmp(static_cast<char*>(header) + DB_HEADER_MAGIC_OFFSET,
+        DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE) == 0;
+}
+
+uint32_t* get_db_header_engine(void* header) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(header) + DB_HEADER_ENGINE_OFFSET);
+}
+
+uint32_t* get_db_header_lsm_num_runs(void* header) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(header) + DB_HEADER_LSM_NUM_RUNS_OFFSET);
+}
+
+uint32_t* get_db_header_lsm_run_field(void* header, uint32_t run_idx, uint32_t field_offset) {
+    char* run = static_cast<char*>(header) + DB_HEADER_LSM_RUNS_OFFSET + run_idx * LSM_RUN_SIZE;
+    return reinterpret_cast<uint32_t*>(run + field_offset);
+}
+
+uint32_t* get_db_header_compressed(void* header) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(header) + DB_HEADER_COMPRESSED_OFFSET);
+}
+
+uint32_t* get_db_header_page_map_field(void* header, uint32_t page_idx, uint32_t field_offset) {
+    char* entry = static_cast<char*>(header) + DB_HEADER_PAGE_MAP_OFFSET + page_idx * PAGE_MAP_ENTRY_SIZE;
+    return reinterpret_cast<uint32_t*>(entry + field_offset);
+}
+
+void init_db_header(void* header, uint32_t page_size, uint32_t root_page_num, StorageEngine engine) {
+    memcpy(static_cast<char*>(header) + DB_HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+    *get_db_header_page_size(header) = page_size;
+    *get_db_header_root_page_num(header) = root_page_num;
+    *get_db_header_engine(header) = engine;
+    *get_db_header_lsm_num_runs(header) = 0;
+}
+
+bool is_valid_page_size(uint32_t page_size) {
+    // power of 2 so that the frames and the file offsets stay aligned
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+        (page_size & (page_size - 1)) == 0;
+}
+
+/*
+* Common node accessors
+*/
+// NOTE: The offsets are in bytes, so the address is computed on a char* before
+// casting it to the type of the field.
+NodeType get_node_type(void* node) {
+    uint8_t value = *(static_cast<uint8_t*>(node) + NODE_TYPE_OFFSET);
+    return static_cast<NodeType>(value);
+}
+
+void set_node_type(void* node, NodeType type) {
+    *(static_cast<uint8_t*>(node) + NODE_TYPE_OFFSET) = static_cast<uint8_t>(type);
+}
+
+bool is_node_root(void* node) {
+    return *(static_cast<uint8_t*>(node) + IS_ROOT_OFFSET);
+}
+
+void set_node_root(void* node, bool is_root) {
+    *(static_cast<uint8_t*>(node) + IS_ROOT_OFFSET) = is_root;
+}
 
+uint32_t* get_node_parent(void* node) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(node) + PARENT_POINTER_OFFSET);
+}
 
 /*
 * Leaf node accessors
 */
 uint32_t* get_leaf_node_num_cells_offset(void* node) {
-    return static_cast<uint32_t*>(node) + LEAF_NODE_NUM_CELLS_OFFSET;
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(node) + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+uint32_t* get_leaf_node_next_leaf(void* node) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(node) + LEAF_NODE_NEXT_LEAF_OFFSET);
 }
 
 void init_leaf_node(void* node) {
-    uint32_t* num_cells = get_leaf_node_num_cells_offset(node);
-    *num_cells = 0;
+    set_node_type(node, LEAF);
+    set_node_root(node, false);
+    *get_leaf_node_num_cells_offset(node) = 0;
+    *get_leaf_node_next_leaf(node) = 0;
 }
 
 // Get the address where the no. of cells for a node is stored
 uint32_t* get_leaf_node_cells(void* node) {
-    return static_cast<uint32_t*>(node) + LEAF_NODE_NUM_CELLS_OFFSET;
+    return get_leaf_node_num_cells_offset(node);
 }
 
 void* get_leaf_node_cell(void* node, uint32_t cell_idx) {
@@ -203,29 +675,379 @@ void* get_leaf_node_value(void* node, uint32_t cell_idx) {
     return static_cast<char*>(cell) + LEAF_NODE_VALUE_OFFSET;
 }
 
+/*
+* Internal node accessors
+*/
+uint32_t* get_internal_node_num_keys(void* node) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(node) + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t* get_internal_node_right_child(void* node) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(node) + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint32_t* get_internal_node_right_child_row_count(void* node) {
+    return reinterpret_cast<uint32_t*>(static_cast<char*>(node) + INTERNAL_NODE_RIGHT_CHILD_ROW_COUNT_OFFSET);
+}
+
+void* get_internal_node_cell(void* node, uint32_t cell_idx) {
+    return static_cast<char*>(node) + INTERNAL_NODE_HEADER_SIZE + (cell_idx * INTERNAL_NODE_CELL_SIZE);
+}
+
+// child_idx == num_keys is the right most child
+uint32_t* get_internal_node_child(void* node, uint32_t child_idx) {
+    if (child_idx == *get_internal_node_num_keys(node))
+        return get_internal_node_right_child(node);
+
+    char* cell = static_cast<char*>(get_internal_node_cell(node, child_idx));
+    return reinterpret_cast<uint32_t*>(cell + INTERNAL_NODE_CHILD_OFFSET);
+}
+
+uint32_t* get_internal_node_child_row_count(void* node, uint32_t child_idx) {
+    if (child_idx == *get_internal_node_num_keys(node))
+        return get_internal_node_right_child_row_count(node);
+
+    char* cell = static_cast<char*>(get_internal_node_cell(node, child_idx));
+    return reinterpret_cast<uint32_t*>(cell + INTERNAL_NODE_CHILD_ROW_COUNT_OFFSET);
+}
+
+uint32_t* get_internal_node_key(void* node, uint32_t key_idx) {
+    char* cell = static_cast<char*>(get_internal_node_cell(node, key_idx));
+    return reinterpret_cast<uint32_t*>(cell + INTERNAL_NODE_KEY_OFFSET);
+}
+
+void init_internal_node(void* node) {
+    set_node_type(node, INTERNAL);
+    set_node_root(node, false);
+    *get_internal_node_num_keys(node) = 0;
+    *get_internal_node_right_child(node) = 0;
+    *get_internal_node_right_child_row_count(node) = 0;
+}
+
+/// @brief Index of the child whose subtree should contain the key, ie the
+/// first child with max key >= key, else the right most child.
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+    uint32_t low = 0, high = *get_internal_node_num_keys(node);
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (*get_internal_node_key(node, mid) >= key)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return low;
+}
+
+/// @brief No. of rows in the subtree rooted at the node.
+uint32_t get_node_row_count(void* node) {
+    if (get_node_type(node) == LEAF)
+        return *get_leaf_node_cells(node);
+
+    uint32_t num_keys = *get_internal_node_num_keys(node);
+    uint32_t row_count = 0;
+    for(uint32_t i = 0; i <= num_keys; i++)
+        row_count += *get_internal_node_child_row_count(node, i);
+
+    return row_count;
+}
+
+
+/*
+* Bloom filter
+*/
+// splitmix64 finalizer, spreads the bits of a key over the whole word
+uint64_t hash_key(uint32_t key, uint64_t seed) {
+    uint64_t hash = key + seed * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+void bloom_init(BloomFilter& bloom, uint32_t num_keys) {
+    uint32_t num_words = (max(num_keys, 1u) * BLOOM_BITS_PER_KEY + 63) / 64;
+    bloom.bits.assign(num_words, 0);
+}
+
+// The bit positions of a key come from two hashes (double hashing)
+void bloom_add(BloomFilter& bloom, uint32_t key) {
+    uint64_t num_bits = bloom.bits.size() * 64;
+    uint64_t hash1 = hash_key(key, 0), hash2 = hash_key(key, 1) | 1;
+
+    for(uint32_t i = 0; i < BLOOM_NUM_HASHES; i++) {
+        uint64_t bit = (hash1 + i * hash2) % num_bits;
+        bloom.bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+/// @brief False means the key is definitely not there, true means it may be.
+bool bloom_may_contain(BloomFilter& bloom, uint32_t key) {
+    uint64_t num_bits = bloom.bits.size() * 64;
+    uint64_t hash1 = hash_key(key, 0), hash2 = hash_key(key, 1) | 1;
+
+    for(uint32_t i = 0; i < BLOOM_NUM_HASHES; i++) {
+        uint64_t bit = (hash1 + i * hash2) % num_bits;
+        if (!(bloom.bits[bit / 64] & (1ULL << (bit % 64))))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+* Page compression
+*/
+// LZ77 in the LZ4 block format: each sequence is a token holding the
+// literal length (high 4 bits) and the match length - LZ_MIN_MATCH (low 4
+// bits), a length of 15 continues in the following bytes (255 means more
+// follow). The token is followed by the literals and a 2 byte little endian
+// offset back to the match. The last sequence only has literals.
+// As LZ4 requires at the end of a block, the last LZ_LAST_LITERALS bytes are
+// always literals and no match starts in the last LZ_MATCH_LIMIT bytes.
+const uint32_t LZ_MIN_MATCH = 4;
+const uint32_t LZ_LAST_LITERALS = 5;
+const uint32_t LZ_MATCH_LIMIT = 12;
+const uint32_t LZ_MAX_OFFSET = 65535;
+const uint32_t LZ_HASH_BITS = 12;
+
+uint32_t lz_read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+unsigned char* lz_write_length(unsigned char* op, uint32_t length) {
+    for(; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+/// @brief Returns the compressed size, or 0 if it does not fit in dest_capacity.
+uint32_t lz_compress(const void* src, uint32_t src_size, void* dest, uint32_t dest_capacity) {
+    const unsigned char* base = static_cast<const unsigned char*>(src);
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* end = base + src_size;
+    unsigned char* op = static_cast<unsigned char*>(dest);
+    unsigned char* op_end = op + dest_capacity;
+
+    // last position each 4 byte sequence was seen at
+    vector<int32_t> table(1 << LZ_HASH_BITS, -1);
+
+    while (true) {
+        uint32_t match_length = 0;
+        const unsigned char* match = nullptr;
+
+        while (static_cast<uint32_t>(end - ip) >= LZ_MATCH_LIMIT) {
+            uint32_t sequence = lz_read32(ip);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+            int32_t candidate = table[hash];
+            table[hash] = ip - base;
+
+            if (candidate >= 0 && ip - base - candidate <= LZ_MAX_OFFSET &&
+                lz_read32(base + candidate) == sequence) {
+                match = base + candidate;
+                match_length = LZ_MIN_MATCH;
+                while (static_cast<uint32_t>(end - ip) - match_length > LZ_LAST_LITERALS &&
+                       ip[match_length] == match[match_length])
+                    match_length++;
+                break;
+            }
+            ip++;
+        }
+
+        if (match == nullptr)
+            ip = end;
+
+        // worst case for the sequence: token, both lengths, literals and offset
+        uint32_t literal_length = ip - anchor;
+        size_t needed = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+        if (static_cast<size_t>(op_end - op) < needed)
+            return 0;
+
+        unsigned char* token = op++;
+        *token = min(literal_length, 15u) << 4;
+        if (literal_length >= 15)
+            op = lz_write_length(op, literal_length - 15);
+        memcpy(op, anchor, literal_length);
+        op += literal_length;
+
+        if (match == nullptr)
+            break;
+
+        uint32_t offset = ip - match;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+
+        uint32_t length_code = match_length - LZ_MIN_MATCH;
+        *token |= min(length_code, 15u);
+        if (length_code >= 15)
+            op = lz_write_length(op, length_code - 15);
+
+        ip += match_length;
+        anchor = ip;
+    }
+
+    return op - static_cast<unsigned char*>(dest);
+}
+
+/// @brief Returns the decompressed size, or 0 if the input is corrupt or
+/// would not fit in dest_capacity. Like the LZ4 decoder, the end of block
+/// rules are checked against dest_capacity.
+uint32_t lz_decompress(const void* src, uint32_t src_size, void* dest, uint32_t dest_capacity) {
+    const unsigned char* ip = static_cast<const unsigned char*>(src);
+    const unsigned char* end = ip + src_size;
+    unsigned char* base = static_cast<unsigned char*>(dest);
+    unsigned char* op = base;
+    unsigned char* op_end = base + dest_capacity;
+
+    auto read_length = [&](uint32_t& length) {
+        unsigned char byte;
+        do {
+            if (ip >= end)
+                return false;
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(literal_length))
+            return 0;
+        if (literal_length > static_cast<size_t>(end - ip) || literal_length > static_cast<size_t>(op_end - op))
+            return 0;
+
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // the last sequence has no match
+        if (ip == end)
+            break;
+
+        if (end - ip < 2 || static_cast<size_t>(op_end - op) < LZ_MATCH_LIMIT)
+            return 0;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        uint32_t match_length = token & 15;
+        if (match_length == 15 && !read_length(match_length))
+            return 0;
+        match_length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > static_cast<size_t>(op - base) ||
+            match_length + LZ_LAST_LITERALS > static_cast<size_t>(op_end - op))
+            return 0;
+
+        // byte by byte, the match may overlap the bytes it produces
+        const unsigned char* match = op - offset;
+        for(uint32_t i = 0; i < match_length; i++)
+            *op++ = match[i];
+    }
+
+    return op - base;
+}
+
+/// @brief Loads a page of a compressed database through the page map.
+void read_compressed_page(Pager& pager, uint32_t page_idx, void* page) {
+    PageExtent& extent = pager.extents[page_idx];
+
+    // never written, a new page
+    if (extent.length == 0)
+        return;
+
+    vector<char> data(extent.length);
+    ssize_t bytes_read = pread(pager.file_descriptor, data.data(), extent.length, extent.offset);
+
+    if (bytes_read != static_cast<ssize_t>(extent.length)) {
+        cerr << "Error reading page " << page_idx << ", errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+    pager.stats.bytes_read += bytes_read;
+
+    if (extent.length == pager.page_size)
+        memcpy(page, data.data(), pager.page_size);
+    else if (lz_decompress(data.data(), extent.length, page, pager.page_size) != pager.page_size) {
+        cerr << "Corrupt compressed page: " << page_idx << endl;
+        exit(EXIT_FAILURE);
+    }
+}
 
 /*
  *   Factory methods
  */
-Pager pager_factory(int fd, uint32_t file_length) {
+
+/// @brief Reserves the memory for all the page frames in one go. The mapping
+/// is page aligned which is also what O_DIRECT needs for its buffers. With
+/// huge pages, we first ask for explicit huge pages and if none are reserved
+/// on the host, fall back to transparent huge pages.
+void allocate_page_arena(Pager& pager, bool huge_pages) {
+    size_t arena_size = static_cast<size_t>(TABLE_MAX_PAGES) * pager.page_size;
+    void* arena = MAP_FAILED;
+
+    if (huge_pages) {
+        arena_size = (arena_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        arena = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (arena == MAP_FAILED && DEBUG_MODE)
+            cout << "MAP_HUGETLB not available, using transparent huge pages" << endl;
+    }
+
+    if (arena == MAP_FAILED) {
+        arena = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (arena == MAP_FAILED) {
+            cerr << "Unable to allocate memory for pages: " << errno << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if (huge_pages)
+            madvise(arena, arena_size, MADV_HUGEPAGE);
+    }
+
+    pager.arena = arena;
+    pager.arena_size = arena_size;
+}
+
+Pager pager_factory(int fd, uint32_t file_length, uint32_t page_size) {
     Pager pager;
 
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
         pager.pages[i] = nullptr;
+        pager.dirty[i] = false;
+        pager.extents[i] = { 0, 0 };
+    }
 
     pager.file_descriptor = fd;
     pager.file_length = file_length;
-    pager.num_pages = file_length / PAGE_SIZE;
+    pager.page_size = page_size;
+    pager.num_pages = file_length / page_size;
+    pager.direct_io = false;
+    pager.compressed = false;
+    pager.arena = nullptr;
+    pager.arena_size = 0;
+    pager.in_transaction = false;
+    pager.transaction_num_pages = 0;
+    pager.stats = {};
     
     return pager;
 }
 
 void free_table(Table& table) {
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        if (table.pager.pages[i] != nullptr) {
-            free(table.pager.pages[i]);
-            table.pager.pages[i] = nullptr;
-        }
+    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+        table.pager.pages[i] = nullptr;
+
+    if (table.pager.arena != nullptr) {
+        munmap(table.pager.arena, table.pager.arena_size);
+        table.pager.arena = nullptr;
     }
 }
 
@@ -256,22 +1078,28 @@ void* get_page(Pager& pager, uint32_t page_idx) {
 
     // cache miss
     if (pager.pages[page_idx] == nullptr) {
-        void* page = malloc(PAGE_SIZE);
-        memset(page, 0, PAGE_SIZE);
-
-        if (page == nullptr) {
-            cerr << "Unable to allocate memory for page" << endl;
-            exit(EXIT_FAILURE);
+        pager.stats.page_misses++;
+        uint32_t page_size = pager.page_size;
+        void* page = static_cast<char*>(pager.arena) + static_cast<size_t>(page_idx) * page_size;
+        memset(page, 0, page_size);
+
+        // compressed pages are found through the page map, not by position
+        if (pager.compressed && page_idx != DB_HEADER_PAGE_NUM) {
+            read_compressed_page(pager, page_idx, page);
+
+            pager.pages[page_idx] = page;
+            pager.num_pages = max(pager.num_pages, page_idx + 1);
+            return page;
         }
 
-        uint32_t num_pages = pager.file_length / PAGE_SIZE;
+        uint32_t num_pages = pager.file_length / page_size;
 
         // Case: There can be scenario where the write op might have been
         // disrupted (eg shutdown etc) and the last page was not written completely
         // and only a part of the entire page was written. To handle that we treat
         // that as complete page and let the system read the data till the pt which is 
         // avail.
-        if(pager.file_length % PAGE_SIZE) {
+        if(pager.file_length % page_size && !pager.compressed) {
             cout << "[WRN] Partial page found at the end of file" << endl;
             num_pages += 1;
         }
@@ -279,13 +1107,14 @@ void* get_page(Pager& pager, uint32_t page_idx) {
         // if the request page is within the existing pages
         if (page_idx < num_pages) {
             // go to the starting position of this page and then load the page
-            lseek(pager.file_descriptor, page_idx * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager.file_descriptor, page, PAGE_SIZE);
+            lseek(pager.file_descriptor, static_cast<off_t>(page_idx) * page_size, SEEK_SET);
+            ssize_t bytes_read = read(pager.file_descriptor, page, page_size);
 
             if (bytes_read == -1) {
                 cerr << "Error reading file: " << errno << endl;
                 exit(EXIT_FAILURE);
             }
+            pager.stats.bytes_read += bytes_read;
         }
 
         // cache the page
@@ -299,211 +1128,1757 @@ void* get_page(Pager& pager, uint32_t page_idx) {
                 cout << "Page Added: Idx: " << page_idx << ", Num_pages: " << pager.num_pages << endl;
         }
     }
+    else {
+        pager.stats.page_hits++;
+    }
     
     return pager.pages[page_idx];
 }
 
-Cursor table_begin(Table& table) {
-    Cursor cursor;
-    cursor.table = &table;
-    cursor.page_num = table.root_page_num;
-    cursor.cell_num = 0;
+/// @brief Returns the page for modification. Open snapshots get a copy of
+/// the page as it was before its first modification since they were taken,
+/// and so does the open transaction, to roll it back.
+void* get_page_for_write(Pager& pager, uint32_t page_idx) {
+    void* page = get_page(pager, page_idx);
+    shared_ptr<vector<char>> image;
 
-    // get the page of root node and using that check if there
-    // are cells in the tree
-    void* page = get_page(table.pager, table.root_page_num);
-    uint32_t num_cells = *get_leaf_node_cells(page);
-    // if there are no leaf nodes, then the table is empty
-    cursor.end_of_table = (num_cells == 0);
+    pager.dirty[page_idx] = true;
 
-    return cursor;
-}
+    if (pager.in_transaction && page_idx < pager.transaction_num_pages &&
+        !pager.before_images.count(page_idx)) {
+        char* data = static_cast<char*>(page);
+        pager.before_images.emplace(page_idx, vector<char>(data, data + pager.page_size));
+    }
 
-Cursor table_end(Table& table) {
-    Cursor cursor;
-    cursor.table = &table;
-    cursor.page_num = table.root_page_num;
+    for(Snapshot* snapshot: pager.snapshots) {
+        if (page_idx >= snapshot->num_pages || snapshot->page_images.count(page_idx))
+            continue;
 
-    void* page = get_page(table.pager, table.root_page_num);
-    uint32_t num_cells = *get_leaf_node_cells(page);
-    cursor.cell_num = num_cells;
+        // one copy serves all the snapshots that still see the current image
+        if (image == nullptr) {
+            char* data = static_cast<char*>(page);
+            image = make_shared<vector<char>>(data, data + pager.page_size);
 
-    cursor.end_of_table = true;
+            if (DEBUG_MODE)
+                cout << "Snapshot page image saved, Page_idx: " << page_idx << endl;
+        }
 
-    return cursor;
-}
+        snapshot->page_images[page_idx] = image;
+    }
 
-void* get_cursor_value_addr(Cursor& cursor) {
-    // NOTE: For now, we take the row index (0 indexed) as the
-    // next row after the last inserted row
-    // page_idx is again 0 indexed
-    int32_t page_idx = cursor.page_num;
+    return page;
+}
 
-    void* page = get_page(cursor.table->pager, page_idx);
+/// @brief Pins the current version of the table. Caller must hold the table lock.
+Snapshot* open_snapshot(Table& table) {
+    Snapshot* snapshot = new Snapshot;
+    snapshot->root_page_num = table.root_page_num;
+    snapshot->num_pages = table.pager.num_pages;
 
-    void* cell_val_addr = get_leaf_node_value(page, cursor.cell_num);
+    if (table.engine == ENGINE_LSM) {
+        snapshot->lsm_runs = table.lsm.runs;
+        snapshot->lsm_memtable = table.lsm.memtable;
+    }
 
-    if (DEBUG_MODE)
-        cout << "CellAddrs: " << static_cast<void*>(cell_val_addr) << " , cell_num: " << cursor.cell_num << ", Page_idx: " << page_idx << endl;
-    return cell_val_addr;
+    table.pager.snapshots.push_back(snapshot);
+    return snapshot;
 }
 
-void cursor_next(Cursor& cursor) {
-    ++cursor.cell_num;
-    uint32_t page_num = cursor.page_num;
+/// @brief Drops the snapshot along with the page images only it referenced.
+/// Caller must hold the table lock.
+void release_snapshot(Table& table, Snapshot* snapshot) {
+    vector<Snapshot*>& snapshots = table.pager.snapshots;
 
-    void* page = get_page(cursor.table->pager, page_num);
-    uint32_t num_cells = *get_leaf_node_cells(page);
+    for(auto it = snapshots.begin(); it != snapshots.end(); it++) {
+        if (*it == snapshot) {
+            snapshots.erase(it);
+            break;
+        }
+    }
 
-    if (cursor.cell_num >= num_cells)
-        cursor.end_of_table = true;
+    delete snapshot;
 }
 
-Pager open_pager(string filename) {
-    int fd = open(
-        filename.c_str(),
-        O_RDWR | // R/W mode 
-            O_CREAT, // Create file if it does not exist
-        S_IWUSR | // User Write permission
-            S_IRUSR // User Read permission
-    );
-    
-    if (fd == -1) {
-        cout << "Unable to open file: " << filename << endl;
-        exit(EXIT_FAILURE);
+/// @brief Copies a page as seen by the snapshot into dest. Only holds the
+/// table lock for the duration of the copy, so writers are not blocked for
+/// longer than that.
+void read_snapshot_page(Table& table, Snapshot& snapshot, uint32_t page_idx, void* dest) {
+    lock_guard<mutex> guard(*table.lock);
+
+    auto image = snapshot.page_images.find(page_idx);
+    if (image != snapshot.page_images.end())
+        memcpy(dest, image->second->data(), table.pager.page_size);
+    else
+        memcpy(dest, get_page(table.pager, page_idx), table.pager.page_size);
+}
+
+/// @brief Returns the page the cursor reads, from the page cache or, for a
+/// snapshot cursor, a copy of the page as seen by the snapshot. The table lock
+/// must be held for the former and must not be held for the latter.
+void* get_cursor_page(Cursor& cursor, uint32_t page_num) {
+    if (cursor.snapshot == nullptr)
+        return get_page(cursor.table->pager, page_num);
+
+    if (cursor.snapshot_page.empty() || cursor.snapshot_page_num != page_num) {
+        cursor.snapshot_page.resize(cursor.table->pager.page_size);
+        read_snapshot_page(*cursor.table, *cursor.snapshot, page_num, cursor.snapshot_page.data());
+        cursor.snapshot_page_num = page_num;
     }
 
-    // Position the fd to the last pos to get the file len
-    off_t file_len = lseek(fd, 0, SEEK_END);
-    // reposition to beginning of file
-    lseek(fd, 0, SEEK_SET);
-    
-    Pager pager = pager_factory(fd, file_len);
+    return cursor.snapshot_page.data();
+}
 
-    return pager;
+/// @brief Copies the live page into dest, holding the table lock only for the copy.
+void read_page(Table& table, uint32_t page_idx, void* dest) {
+    lock_guard<mutex> guard(*table.lock);
+    memcpy(dest, get_page(table.pager, page_idx), table.pager.page_size);
 }
 
-Table open_db_conn(string filename) {
+/// @brief Max key stored in the subtree rooted at the node.
+uint32_t get_node_max_key(Pager& pager, void* node) {
+    if (get_node_type(node) == LEAF)
+        return *get_leaf_node_key(node, *get_leaf_node_cells(node) - 1);
+
+    void* right_child = get_page(pager, *get_internal_node_right_child(node));
+    return get_node_max_key(pager, right_child);
+}
+
+/// @brief Index of the first cell with key >= the given key.
+uint32_t leaf_node_find_cell(void* node, uint32_t key) {
+    uint32_t low = 0, high = *get_leaf_node_cells(node);
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (*get_leaf_node_key(node, mid) >= key)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return low;
+}
+
+uint32_t table_row_count(Table& table) {
+    if (table.engine == ENGINE_LSM) {
+        uint32_t row_count = table.lsm.memtable.size();
+        for(LsmRun& run: table.lsm.runs)
+            row_count += run.num_rows;
+
+        return row_count;
+    }
+
+    return get_node_row_count(get_page(table.pager, table.root_page_num));
+}
+
+/// @brief Returns the position of the key, or the position where it should
+/// be inserted if the key is not in the table.
+Cursor table_find(Table& table, uint32_t key) {
+    uint32_t page_num = table.root_page_num;
+    void* node = get_page(table.pager, page_num);
+
+    while (get_node_type(node) == INTERNAL) {
+        uint32_t child_idx = internal_node_find_child(node, key);
+        page_num = *get_internal_node_child(node, child_idx);
+        node = get_page(table.pager, page_num);
+    }
+
+    Cursor cursor;
+    cursor.table = &table;
+    cursor.page_num = page_num;
+    cursor.cell_num = leaf_node_find_cell(node, key);
+    cursor.end_of_table = cursor.cell_num >= *get_leaf_node_cells(node) &&
+        *get_leaf_node_next_leaf(node) == 0;
+
+    return cursor;
+}
+
+/// @brief No. of rows with a key smaller than the given key. Only the child
+/// row counts along the path to the key's leaf are summed, so this is
+/// O(log n) and not a scan.
+uint32_t table_rank(Table& table, uint32_t key) {
+    uint32_t rank = 0;
+    void* node = get_page(table.pager, table.root_page_num);
+
+    while (get_node_type(node) == INTERNAL) {
+        uint32_t child_idx = internal_node_find_child(node, key);
+        for(uint32_t i = 0; i < child_idx; i++)
+            rank += *get_internal_node_child_row_count(node, i);
+
+        node = get_page(table.pager, *get_internal_node_child(node, child_idx));
+    }
+
+    return rank + leaf_node_find_cell(node, key);
+}
+
+/// @brief Returns a cursor to the row at the given rank (0 indexed) in key
+/// order, the cursor is at the end of table if there are not enough rows.
+/// With a snapshot, the cursor reads the table as of the snapshot.
+Cursor table_at_rank(Table& table, uint32_t rank, Snapshot* snapshot = nullptr) {
+    Cursor cursor;
+    cursor.table = &table;
+    cursor.snapshot = snapshot;
+
+    uint32_t page_num = snapshot ? snapshot->root_page_num : table.root_page_num;
+    void* node = get_cursor_page(cursor, page_num);
+
+    // skip over the children whose subtrees only have rows of smaller rank
+    while (get_node_type(node) == INTERNAL) {
+        uint32_t num_keys = *get_internal_node_num_keys(node);
+        uint32_t child_idx = 0;
+
+        while (child_idx < num_keys && rank >= *get_internal_node_child_row_count(node, child_idx)) {
+            rank -= *get_internal_node_child_row_count(node, child_idx);
+            child_idx++;
+        }
+
+        page_num = *get_internal_node_child(node, child_idx);
+        node = get_cursor_page(cursor, page_num);
+    }
+
+    cursor.page_num = page_num;
+    cursor.cell_num = rank;
+    cursor.end_of_table = rank >= *get_leaf_node_cells(node);
+
+    return cursor;
+}
+
+/// @brief Moves a cursor over a chain of leaves to the next cell.
+void leaf_cursor_next(Cursor& cursor) {
+    ++cursor.cell_num;
+    uint32_t page_num = cursor.page_num;
+
+    void* page = get_cursor_page(cursor, page_num);
+    uint32_t num_cells = *get_leaf_node_cells(page);
+
+    // move on to the next leaf, if this was the right most leaf then
+    // there are no more rows
+    if (cursor.cell_num >= num_cells) {
+        uint32_t next_leaf = *get_leaf_node_next_leaf(page);
+
+        if (next_leaf == 0) {
+            cursor.end_of_table = true;
+        }
+        else {
+            cursor.page_num = next_leaf;
+            cursor.cell_num = 0;
+        }
+    }
+}
+
+uint32_t get_leaf_cursor_key(Cursor& cursor) {
+    return *get_leaf_node_key(get_cursor_page(cursor, cursor.page_num), cursor.cell_num);
+}
+
+/// @brief Returns a cursor to the first row of the run with key >= the key.
+/// The fences lead straight to the one page that can have the key.
+Cursor lsm_run_seek(Table& table, LsmRun& run, uint32_t key, Snapshot* snapshot = nullptr) {
+    auto fence = upper_bound(run.page_min_keys.begin(), run.page_min_keys.end(), key);
+    uint32_t page_idx = fence == run.page_min_keys.begin() ? 0 : (fence - run.page_min_keys.begin()) - 1;
+
+    Cursor cursor;
+    cursor.table = &table;
+    cursor.snapshot = snapshot;
+    cursor.page_num = run.pages[page_idx];
+    cursor.end_of_table = false;
+
+    void* node = get_cursor_page(cursor, cursor.page_num);
+    cursor.cell_num = leaf_node_find_cell(node, key);
+
+    // all the keys in this page are smaller, the row is the first of the next page
+    if (cursor.cell_num >= *get_leaf_node_cells(node)) {
+        cursor.cell_num--;
+        leaf_cursor_next(cursor);
+    }
+
+    return cursor;
+}
+
+/// @brief Positions the merged cursor at the source with the smallest key.
+/// The keys are unique across the memtable and the runs.
+void lsm_cursor_settle(Cursor& cursor) {
+    auto& memtable = cursor.snapshot ? cursor.snapshot->lsm_memtable : cursor.table->lsm.memtable;
+    uint32_t min_key = 0;
+    cursor.source = LSM_SOURCE_NONE;
+
+    if (cursor.memtable_it != memtable.end()) {
+        cursor.source = LSM_SOURCE_MEMTABLE;
+        min_key = cursor.memtable_it->first;
+    }
+
+    for(uint32_t i = 0; i < cursor.run_cursors.size(); i++) {
+        Cursor& run_cursor = cursor.run_cursors[i];
+        if (run_cursor.end_of_table)
+            continue;
+
+        uint32_t key = get_leaf_cursor_key(run_cursor);
+        if (cursor.source == LSM_SOURCE_NONE || key < min_key) {
+            cursor.source = i;
+            min_key = key;
+        }
+    }
+
+    cursor.end_of_table = cursor.source == LSM_SOURCE_NONE;
+}
+
+/// @brief Returns a merged cursor to the first row with key >= the key.
+/// With a snapshot, the cursor reads the runs and memtable of the snapshot.
+Cursor lsm_seek(Table& table, uint32_t key, Snapshot* snapshot = nullptr) {
+    Cursor cursor;
+    cursor.table = &table;
+    cursor.snapshot = snapshot;
+    cursor.page_num = 0;
+    cursor.cell_num = 0;
+
+    auto& memtable = snapshot ? snapshot->lsm_memtable : table.lsm.memtable;
+    cursor.memtable_it = memtable.lower_bound(key);
+
+    for(LsmRun& run: snapshot ? snapshot->lsm_runs : table.lsm.runs) {
+        // runs whose keys are all smaller have nothing to contribute
+        if (run.max_key >= key)
+            cursor.run_cursors.push_back(lsm_run_seek(table, run, key, snapshot));
+    }
+
+    lsm_cursor_settle(cursor);
+    return cursor;
+}
+
+Cursor table_begin(Table& table) {
+    if (table.engine == ENGINE_LSM)
+        return lsm_seek(table, 0);
+
+    return table_at_rank(table, 0);
+}
+
+uint32_t get_cursor_key(Cursor& cursor) {
+    if (cursor.table->engine == ENGINE_LSM) {
+        if (cursor.source == LSM_SOURCE_MEMTABLE)
+            return cursor.memtable_it->first;
+
+        return get_leaf_cursor_key(cursor.run_cursors[cursor.source]);
+    }
+
+    return get_leaf_cursor_key(cursor);
+}
+
+void* get_leaf_cursor_value_addr(Cursor& cursor) {
+    // NOTE: For now, we take the row index (0 indexed) as the
+    // next row after the last inserted row
+    // page_idx is again 0 indexed
+    int32_t page_idx = cursor.page_num;
+
+    void* page = get_cursor_page(cursor, page_idx);
+
+    void* cell_val_addr = get_leaf_node_value(page, cursor.cell_num);
+
+    if (DEBUG_MODE)
+        cout << "CellAddrs: " << static_cast<void*>(cell_val_addr) << " , cell_num: " << cursor.cell_num << ", Page_idx: " << page_idx << endl;
+    return cell_val_addr;
+}
+
+void* get_cursor_value_addr(Cursor& cursor) {
+    if (cursor.table->engine == ENGINE_LSM) {
+        if (cursor.source == LSM_SOURCE_MEMTABLE)
+            return cursor.memtable_it->second.data();
+
+        return get_leaf_cursor_value_addr(cursor.run_cursors[cursor.source]);
+    }
+
+    return get_leaf_cursor_value_addr(cursor);
+}
+
+void cursor_next(Cursor& cursor) {
+    if (cursor.table->engine != ENGINE_LSM) {
+        leaf_cursor_next(cursor);
+        return;
+    }
+
+    // only the source the cursor is at moves ahead
+    if (cursor.source == LSM_SOURCE_MEMTABLE)
+        cursor.memtable_it++;
+    else
+        leaf_cursor_next(cursor.run_cursors[cursor.source]);
+
+    lsm_cursor_settle(cursor);
+}
+
+/*
+* Workload trace
+*/
+void trace_write_varint(string& buffer, uint64_t value) {
+    do {
+        char byte = value & 0x7f;
+        value >>= 7;
+        buffer.push_back(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+bool trace_read_varint(const string& data, size_t& pos, uint64_t& value) {
+    value = 0;
+    for(uint32_t shift = 0; pos < data.size() && shift < 64; shift += 7) {
+        unsigned char byte = data[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+void trace_flush(TraceRecorder& trace) {
+    if (write(trace.fd, trace.buffer.data(), trace.buffer.size()) != static_cast<ssize_t>(trace.buffer.size()))
+        cerr << "Failed to write the trace, errno: " << errno << endl;
+    trace.buffer.clear();
+}
+
+unique_ptr<TraceRecorder> trace_open(string& path) {
+    auto trace = make_unique<TraceRecorder>();
+    trace->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+
+    if (trace->fd == -1) {
+        cerr << "Unable to open trace file: " << path << ", errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    trace->buffer.append(TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    trace->last_time = chrono::steady_clock::now();
+    return trace;
+}
+
+void trace_record(TraceRecorder& trace, uint32_t session_id, const string& line) {
+    lock_guard<mutex> guard(trace.lock);
+
+    auto now = chrono::steady_clock::now();
+    auto delta = chrono::duration_cast<chrono::microseconds>(now - trace.last_time).count();
+    trace.last_time = now;
+
+    trace_write_varint(trace.buffer, delta);
+    trace_write_varint(trace.buffer, session_id);
+    trace_write_varint(trace.buffer, line.size());
+    trace.buffer += line;
+
+    if (trace.buffer.size() >= TRACE_BUFFER_SIZE)
+        trace_flush(trace);
+}
+
+void trace_close(TraceRecorder& trace) {
+    trace_flush(trace);
+    close(trace.fd);
+}
+
+/// @brief Logs an input line with --record. A line that runs against the
+/// table is logged while holding the table lock, so the trace has the lines
+/// of all the sessions in the order they ran.
+void record_input(Table& table, uint32_t session_id, const string& input) {
+    if (table.trace)
+        trace_record(*table.trace, session_id, input);
+}
+
+string get_journal_path(const string& filename) {
+    return filename + "-journal";
+}
+
+/// @brief Syncs the directory holding the file, so that creating or deleting
+/// the file survives a power loss. For the journal, its deletion is the commit
+/// point.
+void sync_directory_of(const string& path) {
+    size_t slash = path.find_last_of('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || fsync(fd) == -1) {
+        cerr << "Failed to sync directory: " << directory << ", errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/// @brief Undoes a commit that was interrupted midway: the pages saved in a
+/// complete journal are written back and the file is cut back to its old length.
+void recover_journal(int fd, const string& filename) {
+    string path = get_journal_path(filename);
+    int journal_fd = open(path.c_str(), O_RDONLY);
+
+    // no journal, the last commit completed
+    if (journal_fd == -1)
+        return;
+
+    char header[JOURNAL_HEADER_SIZE];
+    ssize_t bytes_read = pread(journal_fd, header, JOURNAL_HEADER_SIZE, 0);
+
+    uint32_t page_size = 0, num_pages = 0;
+    uint64_t file_length = 0;
+    bool hot = bytes_read == JOURNAL_HEADER_SIZE &&
+        memcmp(header + JOURNAL_MAGIC_OFFSET, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) == 0;
+
+    if (hot) {
+        memcpy(&page_size, header + JOURNAL_PAGE_SIZE_OFFSET, JOURNAL_PAGE_SIZE_SIZE);
+        memcpy(&num_pages, header + JOURNAL_NUM_PAGES_OFFSET, JOURNAL_NUM_PAGES_SIZE);
+        memcpy(&file_length, header + JOURNAL_FILE_LENGTH_OFFSET, JOURNAL_FILE_LENGTH_SIZE);
+
+        // The header is written last, once the entries are synced. One that
+        // write_journal could not have written is not from a commit.
+        if (!is_valid_page_size(page_size) || num_pages > TABLE_MAX_PAGES ||
+            file_length > static_cast<uint64_t>(TABLE_MAX_PAGES) * page_size) {
+            cerr << "[WRN] Ignoring invalid journal: " << path << endl;
+            hot = false;
+        }
+    }
+
+    if (hot) {
+        size_t entry_size = JOURNAL_PAGE_NUM_SIZE + page_size;
+        vector<char> entry(entry_size);
+
+        for(uint32_t i = 0; i < num_pages; i++) {
+            off_t offset = JOURNAL_HEADER_SIZE + static_cast<off_t>(i) * entry_size;
+            if (pread(journal_fd, entry.data(), entry_size, offset) != static_cast<ssize_t>(entry_size)) {
+                cerr << "Corrupt journal: " << path << endl;
+                exit(EXIT_FAILURE);
+            }
+
+            uint32_t page_num;
+            memcpy(&page_num, entry.data(), JOURNAL_PAGE_NUM_SIZE);
+            if (page_num >= TABLE_MAX_PAGES) {
+                cerr << "Corrupt journal: " << path << endl;
+                exit(EXIT_FAILURE);
+            }
+
+            off_t page_offset = static_cast<off_t>(page_num) * page_size;
+            if (pwrite(fd, entry.data() + JOURNAL_PAGE_NUM_SIZE, page_size, page_offset) != page_size) {
+                cerr << "Failed to roll back page " << page_num << ", errno: " << errno << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (ftruncate(fd, file_length) == -1 || fsync(fd) == -1) {
+            cerr << "Failed to roll back " << filename << ", errno: " << errno << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        cout << "[WRN] Rolled back an interrupted commit from " << path << endl;
+    }
+
+    close(journal_fd);
+    unlink(path.c_str());
+    sync_directory_of(path);
+}
+
+Pager open_pager(DbOptions& options) {
+    string& filename = options.filename;
+    int fd = open(
+        filename.c_str(),
+        O_RDWR | // R/W mode 
+            O_CREAT, // Create file if it does not exist
+        S_IWUSR | // User Write permission
+            S_IRUSR // User Read permission
+    );
+    
+    if (fd == -1) {
+        cout << "Unable to open file: " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    recover_journal(fd, filename);
+
+    // Position the fd to the last pos to get the file len
+    off_t file_len = lseek(fd, 0, SEEK_END);
+    // reposition to beginning of file
+    lseek(fd, 0, SEEK_SET);
+
+    // Existing database: the page size is whatever the file was created with
+    uint32_t page_size = options.page_size;
+    char header[DB_HEADER_SIZE];
+    if (file_len > 0) {
+        ssize_t bytes_read = pread(fd, header, DB_HEADER_SIZE, 0);
+
+        if (bytes_read != DB_HEADER_SIZE || !is_db_header_valid(header)) {
+            cerr << "Unrecognized database file format: " << filename << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        page_size = *get_db_header_page_size(header);
+        if (!is_valid_page_size(page_size)) {
+            cerr << "Invalid page size in database header: " << page_size << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if (DEBUG_MODE && page_size != options.page_size)
+            cout << "Using page size " << page_size << " from the database header" << endl;
+    }
+    
+    Pager pager = pager_factory(fd, file_len, page_size);
+
+    // The file past the header is a sequence of extents, the pages stored in
+    // it are listed in the page map.
+    pager.compressed = file_len > 0 ? *get_db_header_compressed(header) : options.compress;
+    if (file_len > 0 && pager.compressed) {
+        pager.num_pages = 1;
+        for(uint32_t i = 1; i < TABLE_MAX_PAGES; i++) {
+            pager.extents[i].offset = *get_db_header_page_map_field(header, i, PAGE_MAP_OFFSET_OFFSET);
+            pager.extents[i].length = *get_db_header_page_map_field(header, i, PAGE_MAP_LENGTH_OFFSET);
+
+            if (pager.extents[i].length > 0)
+                pager.num_pages = i + 1;
+        }
+    }
+
+    // The header is read with buffered I/O above, from here on all the I/O is
+    // in whole aligned pages so the kernel page cache can be bypassed.
+    // Extents are neither page sized nor page aligned, so not when compressed.
+    if (options.direct_io && pager.compressed) {
+        cout << "[WRN] O_DIRECT not supported for compressed databases, using buffered I/O" << endl;
+    }
+    else if (options.direct_io) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+            cout << "[WRN] O_DIRECT not supported for " << filename << ", using buffered I/O" << endl;
+        else
+            pager.direct_io = true;
+    }
+
+    return pager;
+}
+
+/// @brief Rebuilds the in memory state of the runs listed in the header:
+/// their pages, the fence keys and the bloom filters. The pages not used by
+/// any run are free.
+void lsm_load_runs(Table& table) {
+    Pager& pager = table.pager;
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    uint32_t num_runs = *get_db_header_lsm_num_runs(header);
+    vector<bool> used_pages(pager.num_pages, false);
+    used_pages[DB_HEADER_PAGE_NUM] = true;
+
+    for(uint32_t i = 0; i < num_runs; i++) {
+        LsmRun run;
+        run.id = table.lsm.next_run_id++;
+        run.num_rows = *get_db_header_lsm_run_field(header, i, LSM_RUN_NUM_ROWS_OFFSET);
+        run.min_key = *get_db_header_lsm_run_field(header, i, LSM_RUN_MIN_KEY_OFFSET);
+        run.max_key = *get_db_header_lsm_run_field(header, i, LSM_RUN_MAX_KEY_OFFSET);
+        bloom_init(run.bloom, run.num_rows);
+
+        uint32_t page_num = *get_db_header_lsm_run_field(header, i, LSM_RUN_FIRST_PAGE_OFFSET);
+        while (page_num != 0) {
+            void* node = get_page(pager, page_num);
+            uint32_t num_cells = *get_leaf_node_cells(node);
+
+            run.pages.push_back(page_num);
+            run.page_min_keys.push_back(*get_leaf_node_key(node, 0));
+            for(uint32_t cell = 0; cell < num_cells; cell++)
+                bloom_add(run.bloom, *get_leaf_node_key(node, cell));
+
+            used_pages[page_num] = true;
+            page_num = *get_leaf_node_next_leaf(node);
+        }
+
+        table.lsm.runs.push_back(run);
+    }
+
+    // reused from the highest page down, so the lowest free page goes first
+    for(uint32_t page_num = pager.num_pages; page_num-- > 0;) {
+        if (!used_pages[page_num])
+            table.lsm.free_pages.push_back(page_num);
+    }
+}
+
+Table open_db_conn(DbOptions& options) {
     Table table;
     
-    table.pager = open_pager(filename);
-    table.root_page_num = 0;
+    table.filename = options.filename;
+    table.pager = open_pager(options);
+    table.lock = make_unique<mutex>();
+    table.backup_lock = make_unique<mutex>();
+    table.transaction_session = REPL_SESSION_ID;
+    if (!options.record_path.empty())
+        table.trace = trace_open(options.record_path);
+    allocate_page_arena(table.pager, options.huge_pages);
+
+    // New database, write the header and initialize the root as leaf node.
+    // The LSM engine has no tree, its runs are listed in the header.
+    if (table.pager.num_pages == 0) {
+        table.engine = options.engine;
+        table.root_page_num = table.engine == ENGINE_LSM ? 0 : DB_HEADER_PAGE_NUM + 1;
+
+        void* header = get_page_for_write(table.pager, DB_HEADER_PAGE_NUM);
+        init_db_header(header, table.pager.page_size, table.root_page_num, table.engine);
+        *get_db_header_compressed(header) = table.pager.compressed;
+
+        if (table.engine == ENGINE_BTREE) {
+            void* root = get_page_for_write(table.pager, table.root_page_num);
+            init_leaf_node(root);
+            set_node_root(root, true);
+        }
+    }
+    else {
+        void* header = get_page(table.pager, DB_HEADER_PAGE_NUM);
+        table.root_page_num = *get_db_header_root_page_num(header);
+        table.engine = static_cast<StorageEngine>(*get_db_header_engine(header));
+
+        if (table.engine == ENGINE_LSM)
+            lsm_load_runs(table);
+    }
+
+    uint32_t num_rows = table_row_count(table);
+    
+    if (DEBUG_MODE)
+        cout << "Loaded " << num_rows << " rows." << endl;
+
+    return table;
+}
+
+/// @brief Writes the pages [first_page, first_page + num_pages) with a
+/// single write, their frames are adjacent in the arena as well.
+void flush_pages(Pager& pager, uint32_t first_page, uint32_t num_pages) {
+    if (first_page + num_pages > pager.num_pages) {
+        cerr << "Page index is out of bounds: " << first_page + num_pages - 1 << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = static_cast<size_t>(num_pages) * pager.page_size;
+    off_t offset = static_cast<off_t>(first_page) * pager.page_size;
+    char* data = static_cast<char*>(pager.arena) + offset;
+
+    pager.stats.pages_written += num_pages;
+    pager.stats.bytes_written += size;
+
+    while (size > 0) {
+        ssize_t bytes_written = pwrite(pager.file_descriptor, data, size, offset);
+
+        if (bytes_written == -1) {
+            cerr << "Failed to save the data to disk, errno: " << errno << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        data += bytes_written;
+        offset += bytes_written;
+        size -= bytes_written;
+    }
+}
+
+// NOTE: The B+ tree never frees pages, so a new page always goes at the end of file
+uint32_t get_unused_page_num(Pager& pager) {
+    return pager.num_pages;
+}
+
+/// @brief Position of the child page in the internal node.
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+    uint32_t num_keys = *get_internal_node_num_keys(node);
+
+    for(uint32_t i = 0; i < num_keys; i++) {
+        if (*get_internal_node_child(node, i) == child_page_num)
+            return i;
+    }
+
+    return num_keys;
+}
+
+/// @brief A row was added under the node, so the subtree of every ancestor
+/// has one more row now. The key leads to the same child as it did when
+/// the row was looked up.
+void update_ancestor_row_counts(Table& table, uint32_t page_num, uint32_t key) {
+    void* node = get_page(table.pager, page_num);
+
+    while (!is_node_root(node)) {
+        void* parent = get_page_for_write(table.pager, *get_node_parent(node));
+        uint32_t child_idx = internal_node_find_child(parent, key);
+        *get_internal_node_child_row_count(parent, child_idx) += 1;
+
+        node = parent;
+    }
+}
+
+/// @brief Splitting the root: a new internal node becomes the root with the
+/// old root as its left child and the new node as its right child.
+void create_new_root(Table& table, uint32_t right_child_page_num) {
+    Pager& pager = table.pager;
+    uint32_t left_child_page_num = table.root_page_num;
+    uint32_t root_page_num = get_unused_page_num(pager);
+
+    void* root = get_page_for_write(pager, root_page_num);
+    void* left_child = get_page_for_write(pager, left_child_page_num);
+    void* right_child = get_page_for_write(pager, right_child_page_num);
+
+    init_internal_node(root);
+    set_node_root(root, true);
+    *get_internal_node_num_keys(root) = 1;
+    *get_internal_node_child(root, 0) = left_child_page_num;
+    *get_internal_node_child_row_count(root, 0) = get_node_row_count(left_child);
+    *get_internal_node_key(root, 0) = get_node_max_key(pager, left_child);
+    *get_internal_node_right_child(root) = right_child_page_num;
+    *get_internal_node_right_child_row_count(root) = get_node_row_count(right_child);
+
+    set_node_root(left_child, false);
+    *get_node_parent(left_child) = root_page_num;
+    *get_node_parent(right_child) = root_page_num;
+
+    // the header tells where the root is when the database is opened again
+    table.root_page_num = root_page_num;
+    void* header = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+    *get_db_header_root_page_num(header) = root_page_num;
+
+    if (DEBUG_MODE)
+        cout << "New root: Page_idx: " << root_page_num << endl;
+}
+
+/// @brief Adds a new child to the internal node, the child's subtree row
+/// count goes along with it.
+void internal_node_insert(Table& table, uint32_t parent_page_num, uint32_t child_page_num) {
+    Pager& pager = table.pager;
+    void* parent = get_page_for_write(pager, parent_page_num);
+    void* child = get_page(pager, child_page_num);
+
+    uint32_t child_max_key = get_node_max_key(pager, child);
+    uint32_t child_row_count = get_node_row_count(child);
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+
+    uint32_t original_num_keys = *get_internal_node_num_keys(parent);
+    uint32_t right_child_page_num = *get_internal_node_right_child(parent);
+    void* right_child = get_page(pager, right_child_page_num);
+    uint32_t right_child_max_key = get_node_max_key(pager, right_child);
+
+    *get_internal_node_num_keys(parent) = original_num_keys + 1;
+
+    // Case: The new child has the largest keys, it becomes the right child
+    // and the current right child moves into the cells
+    if (child_max_key > right_child_max_key) {
+        uint32_t right_child_row_count = *get_internal_node_right_child_row_count(parent);
+
+        *get_internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *get_internal_node_child_row_count(parent, original_num_keys) = right_child_row_count;
+        *get_internal_node_key(parent, original_num_keys) = right_child_max_key;
+
+        *get_internal_node_right_child(parent) = child_page_num;
+        *get_internal_node_right_child_row_count(parent) = child_row_count;
+        return;
+    }
+
+    // make room for the new cell
+    memmove(get_internal_node_cell(parent, index + 1), get_internal_node_cell(parent, index),
+        (original_num_keys - index) * INTERNAL_NODE_CELL_SIZE);
+
+    *get_internal_node_child(parent, index) = child_page_num;
+    *get_internal_node_child_row_count(parent, index) = child_row_count;
+    *get_internal_node_key(parent, index) = child_max_key;
+}
+
+/// @brief The leaf is full, so a new leaf takes the upper half of the cells
+/// and the row goes into whichever half it belongs to.
+void leaf_node_split_and_insert(Cursor& cursor, uint32_t key, Row& row) {
+    Table& table = *cursor.table;
+    Pager& pager = table.pager;
+    uint32_t page_size = pager.page_size;
+
+    void* old_node = get_page_for_write(pager, cursor.page_num);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page_for_write(pager, new_page_num);
+
+    init_leaf_node(new_node);
+    *get_node_parent(new_node) = *get_node_parent(old_node);
+    *get_leaf_node_next_leaf(new_node) = *get_leaf_node_next_leaf(old_node);
+    *get_leaf_node_next_leaf(old_node) = new_page_num;
+
+    // All the existing cells and the new one are divided between the two
+    // leaves. Going from the last cell, so that a cell is never overwritten
+    // before it is moved.
+    uint32_t left_split_count = leaf_node_left_split_count(page_size);
+    for(int32_t i = leaf_node_max_cells(page_size); i >= 0; i--) {
+        uint32_t cell_idx = i;
+        void* dest_node = old_node;
+
+        if (cell_idx >= left_split_count) {
+            dest_node = new_node;
+            cell_idx -= left_split_count;
+        }
+
+        void* dest = get_leaf_node_cell(dest_node, cell_idx);
+
+        if (static_cast<uint32_t>(i) == cursor.cell_num) {
+            *get_leaf_node_key(dest_node, cell_idx) = key;
+            write_row(get_leaf_node_value(dest_node, cell_idx), row);
+        }
+        else if (static_cast<uint32_t>(i) > cursor.cell_num) {
+            memmove(dest, get_leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+        }
+        else {
+            memmove(dest, get_leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+        }
+    }
+
+    *get_leaf_node_cells(old_node) = left_split_count;
+    *get_leaf_node_cells(new_node) = leaf_node_right_split_count(page_size);
+
+    if (DEBUG_MODE)
+        cout << "Leaf split: Page_idx: " << cursor.page_num << ", New page_idx: " << new_page_num << endl;
+
+    if (is_node_root(old_node)) {
+        create_new_root(table, new_page_num);
+        return;
+    }
+
+    // The old leaf lost its upper half, so its max key and row count in the
+    // parent change. The right most child has no key of its own.
+    uint32_t parent_page_num = *get_node_parent(old_node);
+    void* parent = get_page_for_write(pager, parent_page_num);
+    uint32_t old_child_idx = internal_node_child_index(parent, cursor.page_num);
+
+    if (old_child_idx < *get_internal_node_num_keys(parent))
+        *get_internal_node_key(parent, old_child_idx) = get_node_max_key(pager, old_node);
+    *get_internal_node_child_row_count(parent, old_child_idx) = left_split_count;
+
+    internal_node_insert(table, parent_page_num, new_page_num);
+    update_ancestor_row_counts(table, parent_page_num, key);
+}
+
+/// @brief Whether a split of the full leaf has the pages it needs.
+bool leaf_node_can_split(Table& table, void* node) {
+    Pager& pager = table.pager;
+
+    // splitting the root also needs a page for the new root
+    uint32_t pages_needed = is_node_root(node) ? 2 : 1;
+    if (pager.num_pages + pages_needed > TABLE_MAX_PAGES)
+        return false;
+
+    if (!is_node_root(node)) {
+        void* parent = get_page(pager, *get_node_parent(node));
+        if (*get_internal_node_num_keys(parent) >= internal_node_max_cells(pager.page_size))
+            return false;
+    }
+
+    return true;
+}
+
+void leaf_node_insert(Cursor& cursor, uint32_t key, Row& row) {
+    Pager& pager = cursor.table->pager;
+    void* node = get_page_for_write(pager, cursor.page_num);
+    uint32_t num_cells = *get_leaf_node_num_cells_offset(node);
+
+    // Case: Leaf node is full
+    if(num_cells >= leaf_node_max_cells(pager.page_size)) {
+        leaf_node_split_and_insert(cursor, key, row);
+        return;
+    }
+
+    // the cursor points to the position where the row should be inserted
+    // To insert that row at ith pos, we move all the i ... nth cells to i+1 ... n+1
+    if (cursor.cell_num < num_cells) {
+        memmove(get_leaf_node_cell(node, cursor.cell_num + 1), get_leaf_node_cell(node, cursor.cell_num),
+            (num_cells - cursor.cell_num) * LEAF_NODE_CELL_SIZE);
+    }
+
+    // insert the row at the ith position
+    *(get_leaf_node_key(node, cursor.cell_num)) = key;
+    write_row(get_leaf_node_value(node, cursor.cell_num), row);
+
+    // cell count is increased
+    *(get_leaf_node_cells(node)) += 1;
+
+    update_ancestor_row_counts(*cursor.table, cursor.page_num, key);
+}
+
+/*
+* LSM engine
+*/
+uint32_t lsm_pages_available(Table& table) {
+    return table.lsm.free_pages.size() + (TABLE_MAX_PAGES - table.pager.num_pages);
+}
+
+uint32_t lsm_pages_for_rows(Table& table, uint32_t num_rows) {
+    uint32_t max_cells = leaf_node_max_cells(table.pager.page_size);
+    return (num_rows + max_cells - 1) / max_cells;
+}
+
+uint32_t lsm_allocate_page(Table& table) {
+    vector<uint32_t>& free_pages = table.lsm.free_pages;
+    uint32_t page_num;
+
+    if (!free_pages.empty()) {
+        page_num = free_pages.back();
+        free_pages.pop_back();
+    }
+    else {
+        page_num = get_unused_page_num(table.pager);
+    }
+
+    // load it right away, a new page at the end of file is only counted once cached
+    get_page_for_write(table.pager, page_num);
+    return page_num;
+}
+
+/// @brief Lists the runs in the header, so they can be found on open.
+void lsm_write_directory(Table& table) {
+    void* header = get_page_for_write(table.pager, DB_HEADER_PAGE_NUM);
+    vector<LsmRun>& runs = table.lsm.runs;
+
+    *get_db_header_lsm_num_runs(header) = runs.size();
+    for(uint32_t i = 0; i < runs.size(); i++) {
+        *get_db_header_lsm_run_field(header, i, LSM_RUN_FIRST_PAGE_OFFSET) = runs[i].pages[0];
+        *get_db_header_lsm_run_field(header, i, LSM_RUN_NUM_ROWS_OFFSET) = runs[i].num_rows;
+        *get_db_header_lsm_run_field(header, i, LSM_RUN_MIN_KEY_OFFSET) = runs[i].min_key;
+        *get_db_header_lsm_run_field(header, i, LSM_RUN_MAX_KEY_OFFSET) = runs[i].max_key;
+    }
+}
+
+/// @brief Writes the rows (sorted by key) out as a new run of full leaves.
+/// Caller must check that there are enough pages available.
+LsmRun lsm_write_run(Table& table, vector<pair<uint32_t, const char*>>& rows) {
+    Pager& pager = table.pager;
+    uint32_t max_cells = leaf_node_max_cells(pager.page_size);
+    uint32_t num_pages = lsm_pages_for_rows(table, rows.size());
+
+    LsmRun run;
+    run.id = table.lsm.next_run_id++;
+    run.num_rows = rows.size();
+    run.min_key = rows.front().first;
+    run.max_key = rows.back().first;
+    bloom_init(run.bloom, run.num_rows);
+
+    for(uint32_t i = 0; i < num_pages; i++)
+        run.pages.push_back(lsm_allocate_page(table));
+
+    for(uint32_t i = 0; i < num_pages; i++) {
+        void* node = get_page_for_write(pager, run.pages[i]);
+        init_leaf_node(node);
+        *get_leaf_node_next_leaf(node) = i + 1 < num_pages ? run.pages[i + 1] : 0;
+
+        uint32_t first_row = i * max_cells;
+        uint32_t num_cells = min(max_cells, static_cast<uint32_t>(rows.size()) - first_row);
+
+        for(uint32_t cell = 0; cell < num_cells; cell++) {
+            uint32_t key = rows[first_row + cell].first;
+            *get_leaf_node_key(node, cell) = key;
+            memcpy(get_leaf_node_value(node, cell), rows[first_row + cell].second, ROW_SIZE);
+            bloom_add(run.bloom, key);
+        }
+
+        *get_leaf_node_cells(node) = num_cells;
+        run.page_min_keys.push_back(rows[first_row].first);
+    }
+
+    return run;
+}
+
+/// @brief Reads the rows of the runs into values, rows points at them sorted
+/// by key. With the table lock held the pages are read from the page cache,
+/// otherwise they are copied out one at a time with read_page.
+void lsm_read_runs(Table& table, vector<LsmRun>& runs, bool locked,
+                   vector<char>& values, vector<pair<uint32_t, const char*>>& rows) {
+    uint32_t num_rows = 0;
+    for(LsmRun& run: runs)
+        num_rows += run.num_rows;
+
+    values.resize(static_cast<size_t>(num_rows) * ROW_SIZE);
+    vector<char> page(table.pager.page_size);
+
+    for(LsmRun& run: runs) {
+        for(uint32_t page_num: run.pages) {
+            void* node = page.data();
+            if (locked)
+                node = get_page(table.pager, page_num);
+            else
+                read_page(table, page_num, page.data());
+            uint32_t num_cells = *get_leaf_node_cells(node);
+
+            for(uint32_t cell = 0; cell < num_cells; cell++) {
+                char* value = values.data() + rows.size() * ROW_SIZE;
+                memcpy(value, get_leaf_node_value(node, cell), ROW_SIZE);
+                rows.push_back({ *get_leaf_node_key(node, cell), value });
+            }
+        }
+    }
+
+    // keys are unique across runs, so there are no versions to reconcile
+    sort(rows.begin(), rows.end(), [](auto& a, auto& b) { return a.first < b.first; });
+}
+
+/// @brief Replaces the input runs with a single run of the rows. Caller must
+/// hold the table lock.
+void lsm_replace_runs(Table& table, vector<LsmRun>& inputs, vector<pair<uint32_t, const char*>>& rows) {
+    LsmTree& lsm = table.lsm;
+
+    // The pages of the merged runs are released first and the new run reuses
+    // them, it never needs more pages than the runs it replaces.
+    for(LsmRun& input: inputs) {
+        for(auto it = lsm.runs.begin(); it != lsm.runs.end(); it++) {
+            if (it->id == input.id) {
+                lsm.runs.erase(it);
+                break;
+            }
+        }
+
+        lsm.free_pages.insert(lsm.free_pages.end(), input.pages.begin(), input.pages.end());
+    }
+    sort(lsm.free_pages.begin(), lsm.free_pages.end(), greater<uint32_t>());
+
+    if (!rows.empty())
+        lsm.runs.push_back(lsm_write_run(table, rows));
+    lsm_write_directory(table);
+
+    if (DEBUG_MODE)
+        cout << "Compaction done: merged runs: " << inputs.size() << ", rows: " << rows.size() << endl;
+}
+
+/// @brief Writes the memtable out as a new run. Inserts only go into the
+/// memtable if there will be room to flush it, see lsm_insert.
+void lsm_flush_memtable(Table& table) {
+    LsmTree& lsm = table.lsm;
+    if (lsm.memtable.empty())
+        return;
+
+    vector<pair<uint32_t, const char*>> rows;
+    for(auto& entry: lsm.memtable)
+        rows.push_back({ entry.first, entry.second.data() });
+
+    // A small memtable (eg written out by a commit) is folded into the newest
+    // run while both fit in one memtable, instead of every small commit
+    // leaving a run of its own behind. Not while a compaction may be merging
+    // that run.
+    uint32_t memtable_rows = LSM_MEMTABLE_PAGES * leaf_node_max_cells(table.pager.page_size);
+    if (!lsm.runs.empty() && !lsm.compaction_running &&
+        lsm.runs.back().num_rows + rows.size() <= memtable_rows) {
+        vector<LsmRun> inputs = { lsm.runs.back() };
+        vector<char> values;
+        vector<pair<uint32_t, const char*>> run_rows;
+        lsm_read_runs(table, inputs, true, values, run_rows);
+
+        rows.insert(rows.end(), run_rows.begin(), run_rows.end());
+        sort(rows.begin(), rows.end(), [](auto& a, auto& b) { return a.first < b.first; });
+
+        lsm_replace_runs(table, inputs, rows);
+        lsm.memtable.clear();
+        return;
+    }
+
+    lsm.runs.push_back(lsm_write_run(table, rows));
+    lsm.memtable.clear();
+    lsm_write_directory(table);
+
+    if (DEBUG_MODE)
+        cout << "Memtable flushed: rows: " << rows.size() << ", runs: " << lsm.runs.size() << endl;
+}
+
+uint32_t lsm_run_tier(Table& table, LsmRun& run) {
+    uint32_t tier_rows = LSM_MEMTABLE_PAGES * leaf_node_max_cells(table.pager.page_size);
+    uint32_t tier = 0;
 
-    // New database, so initialize the first page as leaf node
-    if (table.pager.num_pages == 0) {
-        void* root = get_page(table.pager, 0);
-        init_leaf_node(root);
+    for(; run.num_rows > tier_rows; tier_rows *= LSM_TIER_FANOUT)
+        tier++;
+    return tier;
+}
+
+/// @brief Ids of the runs to merge next: the runs of the lowest tier that has
+/// LSM_TIER_FANOUT of them, none if no tier is full. Caller must hold the
+/// table lock.
+vector<uint32_t> lsm_pick_compaction(Table& table) {
+    map<uint32_t, vector<uint32_t>> tiers;
+    for(LsmRun& run: table.lsm.runs)
+        tiers[lsm_run_tier(table, run)].push_back(run.id);
+
+    for(auto& [tier, run_ids]: tiers) {
+        if (run_ids.size() >= LSM_TIER_FANOUT)
+            return run_ids;
     }
 
-    int32_t num_rows = table.pager.file_length / ROW_SIZE;
-    
-    // Case: Partial last page -> In the last page, there might be only few rows written and the
-    // remaining row slots are empty, detect the actual rows in the last page.
-    // For a partially filled page, we still load the entire page in the memory and hence we
-    // need to know how many rows are actually filled in the last page.
-    if (num_rows > 0) {
-        Row empty_row = {0, "", ""};
-        Row row; 
-
-        void* last_page = get_page(table.pager, table.pager.num_pages - 1);
-
-        int32_t empty_rows = 0;
-        for(int i = 0; i < ROWS_PER_PAGE; i++) {
-            read_row(last_page + i * ROW_SIZE, row);
-            
-            if (memcmp(&row, &empty_row, ROW_SIZE) == 0) {
-                empty_rows++;
+    return {};
+}
+
+vector<LsmRun> lsm_runs_with_ids(Table& table, vector<uint32_t>& run_ids) {
+    vector<LsmRun> runs;
+    for(LsmRun& run: table.lsm.runs) {
+        if (find(run_ids.begin(), run_ids.end(), run.id) != run_ids.end())
+            runs.push_back(run);
+    }
+
+    return runs;
+}
+
+/// @brief Merges the runs of a full tier into a single run, and again for as
+/// long as a tier is full. The runs are immutable, so they are read without
+/// blocking the writers, the table lock is only held to pick the runs, to copy
+/// a page out and to swap the runs.
+void lsm_compact(Table& table) {
+    while (true) {
+        vector<LsmRun> inputs;
+        uint32_t generation;
+        {
+            lock_guard<mutex> guard(*table.lock);
+            vector<uint32_t> run_ids = lsm_pick_compaction(table);
+
+            if (run_ids.empty()) {
+                table.lsm.compaction_running = false;
+                return;
             }
+
+            inputs = lsm_runs_with_ids(table, run_ids);
+            generation = table.lsm.generation;
         }
 
-        num_rows -= empty_rows;
+        vector<char> values;
+        vector<pair<uint32_t, const char*>> rows;
+        lsm_read_runs(table, inputs, false, values, rows);
 
-        if (DEBUG_MODE)
-            cout << "Found " << empty_rows << " empty rows in the last page" << endl;
+        lock_guard<mutex> guard(*table.lock);
+
+        // a rollback (or a merge in the foreground) changed the runs
+        // meanwhile, the inputs may be gone
+        if (table.lsm.generation != generation) {
+            table.lsm.compaction_running = false;
+            return;
+        }
+
+        lsm_replace_runs(table, inputs, rows);
     }
+}
 
-    table.num_rows = num_rows;
-    
-    if (DEBUG_MODE)
-        cout << "Loaded " << num_rows << " rows." << endl;
+/// @brief Merges a full tier right away, for an insert that finds the runs at
+/// LSM_MAX_RUNS because the background compaction has not caught up. Caller
+/// must hold the table lock.
+void lsm_compact_now(Table& table) {
+    vector<uint32_t> run_ids = lsm_pick_compaction(table);
+    if (run_ids.empty())
+        return;
 
-    return table;
+    vector<LsmRun> inputs = lsm_runs_with_ids(table, run_ids);
+    vector<char> values;
+    vector<pair<uint32_t, const char*>> rows;
+    lsm_read_runs(table, inputs, true, values, rows);
+
+    lsm_replace_runs(table, inputs, rows);
+
+    // a background compaction may have read the same runs, it must not
+    // swap them out a second time
+    table.lsm.generation++;
 }
 
-void flush_page(Pager& pager, uint32_t page_idx) {
-    int fd = pager.file_descriptor;
+/// @brief Starts a background compaction if a tier is full. Caller must hold
+/// the table lock. Inside a transaction the merged run is written through
+/// get_page_for_write like any other change, so a rollback undoes it too.
+void lsm_schedule_compaction(Table& table) {
+    LsmTree& lsm = table.lsm;
+    if (lsm.compaction_running || lsm_pick_compaction(table).empty())
+        return;
 
-    if (page_idx >= pager.num_pages) {
-        cerr << "Page index is out of bounds: " << page_idx << endl;
-        exit(EXIT_FAILURE);
+    // the previous compaction is done, only its thread is left to join
+    if (lsm.compaction_worker.joinable())
+        lsm.compaction_worker.join();
+
+    lsm.compaction_running = true;
+    lsm.compaction_worker = thread(lsm_compact, ref(table));
+}
+
+void wait_for_compaction(Table& table) {
+    if (table.lsm.compaction_worker.joinable())
+        table.lsm.compaction_worker.join();
+}
+
+/// @brief Point lookup, the bloom filters rule out most runs without reading them.
+bool lsm_contains(Table& table, uint32_t key) {
+    if (table.lsm.memtable.count(key))
+        return true;
+
+    for(LsmRun& run: table.lsm.runs) {
+        if (key < run.min_key || key > run.max_key || !bloom_may_contain(run.bloom, key))
+            continue;
+
+        Cursor cursor = lsm_run_seek(table, run, key);
+        if (!cursor.end_of_table && get_leaf_cursor_key(cursor) == key)
+            return true;
     }
 
-    if (pager.pages[page_idx] == nullptr) {
-        cerr << "Null page cannot be flushed" << endl;
-        exit(EXIT_FAILURE);
+    return false;
+}
+
+ExecuteResult lsm_insert(Table& table, Row& row) {
+    LsmTree& lsm = table.lsm;
+    uint32_t key = row.id;
+
+    if (lsm_contains(table, key))
+        return EXECUTE_DUPLICATE_KEY;
+
+    if (lsm.runs.size() >= LSM_MAX_RUNS)
+        lsm_compact_now(table);
+
+    // Whatever is in the memtable has to fit in a new run, be it when it
+    // fills up or when the database is closed.
+    uint32_t pages_needed = lsm_pages_for_rows(table, lsm.memtable.size() + 1);
+    if (lsm.runs.size() >= LSM_MAX_RUNS || lsm_pages_available(table) < pages_needed)
+        return EXECUTE_TABLE_FULL;
+
+    vector<char> value(ROW_SIZE);
+    write_row(value.data(), row);
+    lsm.memtable.emplace(key, move(value));
+
+    if (lsm.memtable.size() >= LSM_MEMTABLE_PAGES * leaf_node_max_cells(table.pager.page_size)) {
+        lsm_flush_memtable(table);
+        lsm_schedule_compaction(table);
     }
-    
-    ssize_t pos = lseek(fd, page_idx * PAGE_SIZE, SEEK_SET);
-    if(pos == -1) {
-        cerr << "Error seeking the file: " << errno << endl;
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+* Transactions
+*/
+/// @brief Writes the file contents that the pages are about to replace to the
+/// journal and syncs it, from here on the commit can be undone.
+void write_journal(Table& table, vector<uint32_t>& page_nums, uint32_t file_pages) {
+    Pager& pager = table.pager;
+    uint32_t page_size = pager.page_size;
+    string path = get_journal_path(table.filename);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        cerr << "Unable to open journal: " << path << ", errno: " << errno << endl;
         exit(EXIT_FAILURE);
     }
 
-    ssize_t bytes_written = write(fd, pager.pages[page_idx], PAGE_SIZE);
+    // pages past the end of file have nothing to restore, the truncate drops them
+    size_t entry_size = JOURNAL_PAGE_NUM_SIZE + page_size;
+    vector<char> entries;
+    uint32_t num_entries = 0;
+
+    // page aligned, the database may be open with O_DIRECT
+    void* page = aligned_alloc(page_size, page_size);
+
+    for(uint32_t page_num: page_nums) {
+        if (page_num >= file_pages)
+            break;
+
+        memset(page, 0, page_size);
+        if (pread(pager.file_descriptor, page, page_size, static_cast<off_t>(page_num) * page_size) == -1) {
+            cerr << "Error reading file: " << errno << endl;
+            exit(EXIT_FAILURE);
+        }
 
-    if (bytes_written == -1) {
-        cerr << "Failed to save the data to disk." << endl;
+        entries.resize(entries.size() + entry_size);
+        char* entry = entries.data() + entries.size() - entry_size;
+        memcpy(entry, &page_num, JOURNAL_PAGE_NUM_SIZE);
+        memcpy(entry + JOURNAL_PAGE_NUM_SIZE, page, page_size);
+        num_entries++;
+    }
+    free(page);
+
+    char header[JOURNAL_HEADER_SIZE];
+    uint64_t file_length = pager.file_length;
+    memcpy(header + JOURNAL_MAGIC_OFFSET, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+    memcpy(header + JOURNAL_PAGE_SIZE_OFFSET, &page_size, JOURNAL_PAGE_SIZE_SIZE);
+    memcpy(header + JOURNAL_NUM_PAGES_OFFSET, &num_entries, JOURNAL_NUM_PAGES_SIZE);
+    memcpy(header + JOURNAL_FILE_LENGTH_OFFSET, &file_length, JOURNAL_FILE_LENGTH_SIZE);
+
+    bool ok = pwrite(fd, entries.data(), entries.size(), JOURNAL_HEADER_SIZE) == static_cast<ssize_t>(entries.size()) &&
+        fsync(fd) == 0 &&
+        pwrite(fd, header, JOURNAL_HEADER_SIZE, 0) == JOURNAL_HEADER_SIZE &&
+        fsync(fd) == 0;
+
+    if (!ok) {
+        cerr << "Failed to write journal: " << path << ", errno: " << errno << endl;
         exit(EXIT_FAILURE);
     }
+    close(fd);
+
+    // the journal only protects the commit once it is sure to be found
+    sync_directory_of(path);
+
+    pager.stats.journal_bytes += JOURNAL_HEADER_SIZE + entries.size();
+    pager.stats.syncs += 3;
 }
 
-void close_db_conn(Table& table) {
-    Pager pager = table.pager;
+/// @brief Commit for a compressed database. The modified pages are compressed
+/// and written to new extents, in the gaps left by earlier commits or at the
+/// end of file, never over an extent the committed page map still uses. So
+/// the header, which holds the page map, is the only page the journal needs.
+void commit_compressed_pages(Table& table) {
+    Pager& pager = table.pager;
+    uint32_t page_size = pager.page_size;
+
+    vector<uint32_t> page_nums;
+    for(uint32_t i = DB_HEADER_PAGE_NUM + 1; i < pager.num_pages; i++) {
+        if (pager.pages[i] && (pager.dirty[i] || pager.extents[i].length == 0))
+            page_nums.push_back(i);
+    }
 
-    // flush the database to disk
-    for(uint32_t i = 0; i < pager.num_pages; i++) {
-        if(pager.pages[i]) {
-            flush_page(pager, i);
-            free(pager.pages[i]);
-            pager.pages[i] = nullptr;
+    if (page_nums.empty() && !pager.dirty[DB_HEADER_PAGE_NUM] && pager.file_length > 0)
+        return;
+
+    // compress into one buffer, a page that does not shrink is stored as is
+    vector<char> data(page_nums.size() * static_cast<size_t>(page_size));
+    vector<PageExtent> new_extents;
+    size_t data_size = 0;
+
+    for(uint32_t page_num: page_nums) {
+        char* dest = data.data() + data_size;
+        uint32_t length = lz_compress(get_page(pager, page_num), page_size, dest, page_size - 1);
+
+        if (length == 0) {
+            memcpy(dest, get_page(pager, page_num), page_size);
+            length = page_size;
         }
+
+        new_extents.push_back({ static_cast<uint32_t>(data_size), length });
+        data_size += length;
     }
 
-    // close the fd and free up the pages
-    int result = close(pager.file_descriptor);
-    if(result == -1) {
-        cerr << "Error closing file descriptor: " << errno << endl;
+    // the free gaps between the extents in use, after the header
+    vector<PageExtent> used;
+    for(uint32_t i = DB_HEADER_PAGE_NUM + 1; i < TABLE_MAX_PAGES; i++) {
+        if (pager.extents[i].length > 0)
+            used.push_back(pager.extents[i]);
+    }
+    sort(used.begin(), used.end(), [](auto& a, auto& b) { return a.offset < b.offset; });
+
+    vector<PageExtent> gaps;
+    uint32_t file_end = page_size;
+    for(PageExtent& extent: used) {
+        if (extent.offset > file_end)
+            gaps.push_back({ file_end, extent.offset - file_end });
+        file_end = max(file_end, extent.offset + extent.length);
+    }
+
+    // first fit, the extents that fit nowhere go at the end; (file offset, index)
+    vector<pair<uint32_t, uint32_t>> placements;
+    for(uint32_t i = 0; i < new_extents.size(); i++) {
+        uint32_t length = new_extents[i].length;
+        uint32_t offset = file_end;
+
+        auto gap = find_if(gaps.begin(), gaps.end(), [length](auto& g) { return g.length >= length; });
+        if (gap != gaps.end()) {
+            offset = gap->offset;
+            gap->offset += length;
+            gap->length -= length;
+        }
+        else {
+            file_end += length;
+        }
+
+        placements.push_back({ offset, i });
+    }
+
+    vector<uint32_t> header_page = { DB_HEADER_PAGE_NUM };
+    write_journal(table, header_page, pager.file_length > 0 ? 1 : 0);
+
+    // extents that end up next to each other in the file go out in one write
+    sort(placements.begin(), placements.end());
+    uint32_t num_writes = 0;
+
+    for(size_t i = 0; i < placements.size();) {
+        string run;
+        uint32_t run_offset = placements[i].first;
+        size_t j = i;
+
+        while (j < placements.size() && placements[j].first == run_offset + run.size()) {
+            PageExtent& extent = new_extents[placements[j].second];
+            run.append(data.data() + extent.offset, extent.length);
+            j++;
+        }
+
+        if (pwrite(pager.file_descriptor, run.data(), run.size(), run_offset) != static_cast<ssize_t>(run.size())) {
+            cerr << "Failed to save the data to disk, errno: " << errno << endl;
+            exit(EXIT_FAILURE);
+        }
+        pager.stats.pages_written += j - i;
+        pager.stats.bytes_written += run.size();
+
+        num_writes++;
+        i = j;
+    }
+
+    // The page map in the cached header is only written here, the extents
+    // array is what the reads go by.
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    for(auto& [offset, i]: placements)
+        pager.extents[page_nums[i]] = { offset, new_extents[i].length };
+
+    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+        *get_db_header_page_map_field(header, i, PAGE_MAP_OFFSET_OFFSET) = pager.extents[i].offset;
+        *get_db_header_page_map_field(header, i, PAGE_MAP_LENGTH_OFFSET) = pager.extents[i].length;
+    }
+    flush_pages(pager, DB_HEADER_PAGE_NUM, 1);
+
+    if (fdatasync(pager.file_descriptor) == -1) {
+        cerr << "Failed to sync " << table.filename << ", errno: " << errno << endl;
         exit(EXIT_FAILURE);
     }
+    pager.stats.syncs++;
+
+    // the commit point, once the deletion is durable
+    unlink(get_journal_path(table.filename).c_str());
+    sync_directory_of(table.filename);
+    pager.stats.syncs++;
+
+    // whatever is past the last extent in use is garbage now
+    uint32_t used_end = page_size;
+    for(uint32_t i = DB_HEADER_PAGE_NUM + 1; i < TABLE_MAX_PAGES; i++)
+        used_end = max(used_end, pager.extents[i].offset + pager.extents[i].length);
+    if (used_end < pager.file_length && ftruncate(pager.file_descriptor, used_end) == 0)
+        pager.file_length = used_end;
+    pager.file_length = max(pager.file_length, used_end);
+
+    pager.dirty[DB_HEADER_PAGE_NUM] = false;
+    for(uint32_t page_num: page_nums)
+        pager.dirty[page_num] = false;
 
+    if (DEBUG_MODE)
+        cout << "Committed pages: " << page_nums.size() << ", compressed bytes: " << data_size
+            << " of " << page_nums.size() * page_size << ", writes: " << num_writes + 1 << endl;
 }
 
-void* insert_leaf_node(Cursor cursor, uint32_t key, Row row) {
-    void* node = get_page(cursor.table->pager, cursor.page_num);
-    uint32_t num_cells = *get_leaf_node_num_cells_offset(node);
+/// @brief Writes all the modified pages to the file as one atomic unit: the
+/// journal goes first, then the pages in file order with adjacent pages
+/// coalesced into a single write, one fsync, and deleting the journal commits.
+void commit_pages(Table& table) {
+    Pager& pager = table.pager;
+    uint32_t page_size = pager.page_size;
+    uint32_t file_pages = (pager.file_length + page_size - 1) / page_size;
+
+    if (pager.compressed) {
+        commit_compressed_pages(table);
+        return;
+    }
 
-    // Case: Leaf node is full
-    if(num_cells >= LEAF_NODE_MAX_CELLS) {
-        cerr << "Leaf node is full, cannot insert more cells" << endl;
+    // pages past the end of file are written even if unmodified, to extend it
+    vector<uint32_t> page_nums;
+    for(uint32_t i = 0; i < pager.num_pages; i++) {
+        if (pager.pages[i] && (pager.dirty[i] || i >= file_pages))
+            page_nums.push_back(i);
+    }
+
+    if (page_nums.empty())
+        return;
+
+    write_journal(table, page_nums, file_pages);
+
+    uint32_t num_writes = 0;
+    for(size_t i = 0; i < page_nums.size();) {
+        size_t j = i + 1;
+        while (j < page_nums.size() && page_nums[j] == page_nums[j - 1] + 1)
+            j++;
+
+        flush_pages(pager, page_nums[i], j - i);
+        num_writes++;
+        i = j;
+    }
+
+    if (fdatasync(pager.file_descriptor) == -1) {
+        cerr << "Failed to sync " << table.filename << ", errno: " << errno << endl;
         exit(EXIT_FAILURE);
     }
+    pager.stats.syncs++;
 
-    // the cursor points to the position where the row should be inserted
-    // To insert that row at ith pos, we move all the i ... nth cells to i+1 ... n+1
-    if (cursor.cell_num < num_cells) {
-        for(uint32_t i = num_cells; i > cursor.cell_num; i--)
-            memcpy(get_leaf_node_cell(node, i), get_leaf_node_cell(node, i-1), ROW_SIZE);
+    // the commit point, once the deletion is durable
+    unlink(get_journal_path(table.filename).c_str());
+    sync_directory_of(table.filename);
+    pager.stats.syncs++;
+
+    for(uint32_t page_num: page_nums)
+        pager.dirty[page_num] = false;
+    pager.file_length = max(pager.file_length, pager.num_pages * page_size);
+
+    if (DEBUG_MODE)
+        cout << "Committed pages: " << page_nums.size() << ", writes: " << num_writes << endl;
+}
+
+ExecuteResult begin_transaction(Table& table, uint32_t session_id, ostream& out) {
+    Pager& pager = table.pager;
+    if (pager.in_transaction)
+        return EXECUTE_TRANSACTION_ACTIVE;
+
+    pager.in_transaction = true;
+    pager.transaction_num_pages = pager.num_pages;
+    table.transaction_session = session_id;
+
+    // the memtable lives in no page, it is saved as a whole
+    if (table.engine == ENGINE_LSM)
+        table.lsm.transaction_memtable = table.lsm.memtable;
+
+    out << "Transaction started." << endl;
+    return EXECUTE_SUCCESS;
+}
+
+void end_transaction(Table& table) {
+    table.pager.in_transaction = false;
+    table.pager.before_images.clear();
+    table.lsm.transaction_memtable.clear();
+}
+
+/// @brief Makes the changes of the open transaction durable.
+ExecuteResult commit_transaction(Table& table, ostream& out) {
+    if (!table.pager.in_transaction)
+        return EXECUTE_NO_TRANSACTION;
+
+    // the memtable is not in any page, write it out so the commit has it
+    if (table.engine == ENGINE_LSM)
+        lsm_flush_memtable(table);
+
+    commit_pages(table);
+    end_transaction(table);
+
+    if (table.engine == ENGINE_LSM)
+        lsm_schedule_compaction(table);
+
+    out << "Transaction committed." << endl;
+    return EXECUTE_SUCCESS;
+}
+
+/// @brief Puts back the pages the open transaction modified, drops the pages
+/// it added and reloads the table state kept in the header.
+ExecuteResult rollback_transaction(Table& table, ostream& out) {
+    Pager& pager = table.pager;
+    if (!pager.in_transaction)
+        return EXECUTE_NO_TRANSACTION;
+
+    // through get_page_for_write, snapshots taken before begin keep their view
+    for(auto& [page_idx, image]: pager.before_images)
+        memcpy(get_page_for_write(pager, page_idx), image.data(), pager.page_size);
+
+    for(uint32_t i = pager.transaction_num_pages; i < pager.num_pages; i++) {
+        pager.pages[i] = nullptr;
+        pager.dirty[i] = false;
+    }
+    pager.num_pages = pager.transaction_num_pages;
+
+    void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+    table.root_page_num = *get_db_header_root_page_num(header);
+
+    if (table.engine == ENGINE_LSM) {
+        LsmTree& lsm = table.lsm;
+        lsm.runs.clear();
+        lsm.free_pages.clear();
+        lsm_load_runs(table);
+        lsm.memtable = move(lsm.transaction_memtable);
+        lsm.generation++;
     }
 
-    // insert the row at the ith position
-    *(get_leaf_node_key(node, cursor.cell_num)) = key;
-    void* row_addr = get_leaf_node_value(node, cursor.cell_num);
-    write_row(row_addr, row);
+    end_transaction(table);
 
-    // cell count is increased
-    *(get_leaf_node_cells(node)) += 1;
+    out << "Transaction rolled back." << endl;
+    return EXECUTE_SUCCESS;
+}
+
+/// @brief Ends a session of the server (or of a replay), a transaction it
+/// left open is rolled back.
+void end_session(Table& table, uint32_t session_id) {
+    lock_guard<mutex> guard(*table.lock);
+
+    record_input(table, session_id, ".exit");
+
+    if (table.pager.in_transaction && table.transaction_session == session_id) {
+        ostringstream discarded;
+        rollback_transaction(table, discarded);
+    }
+}
+
+/// @brief Streams the snapshot to a new file, page by page. Runs on its own
+/// thread so that statements can keep modifying the table meanwhile.
+void backup_snapshot(Table& table, Snapshot* snapshot, string path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+
+    if (fd == -1) {
+        cerr << "Unable to open backup file: " << path << ", errno: " << errno << endl;
+    }
+    else {
+        vector<char> page(table.pager.page_size);
+        uint32_t page_idx = 0;
+
+        for(; page_idx < snapshot->num_pages; page_idx++) {
+            read_snapshot_page(table, *snapshot, page_idx, page.data());
+
+            // the backup is written page by page, uncompressed
+            if (page_idx == DB_HEADER_PAGE_NUM && *get_db_header_compressed(page.data())) {
+                *get_db_header_compressed(page.data()) = false;
+                memset(get_db_header_page_map_field(page.data(), 0, PAGE_MAP_OFFSET_OFFSET), 0,
+                    TABLE_MAX_PAGES * PAGE_MAP_ENTRY_SIZE);
+            }
+
+            if (write(fd, page.data(), page.size()) != static_cast<ssize_t>(page.size())) {
+                cerr << "Failed to write backup page " << page_idx << " to " << path << ", errno: " << errno << endl;
+                break;
+            }
+        }
+
+        if (fsync(fd) == -1)
+            cerr << "Failed to sync backup file: " << path << ", errno: " << errno << endl;
+        close(fd);
+
+        if (DEBUG_MODE)
+            cout << "Backup written: " << path << ", pages: " << page_idx << endl;
+    }
+
+    lock_guard<mutex> guard(*table.lock);
+    release_snapshot(table, snapshot);
+}
+
+/// @brief Waits for the running backup (if any) to complete.
+void wait_for_backup(Table& table) {
+    lock_guard<mutex> guard(*table.backup_lock);
+
+    if (table.backup_worker.joinable())
+        table.backup_worker.join();
+}
+
+/// @brief True while another session has a transaction open, the caller
+/// holds the table lock.
+bool locked_by_other_session(Table& table, uint32_t session_id) {
+    return table.pager.in_transaction && table.transaction_session != session_id;
+}
+
+/// @brief Fails if a transaction is open, its changes are not committed yet
+/// and must not end up in the backup.
+ExecuteResult start_backup(Table& table, string path, uint32_t session_id, const string& input) {
+    // only one backup at a time, held until the new one is started
+    lock_guard<mutex> backup_guard(*table.backup_lock);
+    if (table.backup_worker.joinable())
+        table.backup_worker.join();
+
+    Snapshot* snapshot;
+    {
+        lock_guard<mutex> guard(*table.lock);
+        record_input(table, session_id, input);
+
+        if (locked_by_other_session(table, session_id))
+            return EXECUTE_LOCKED;
+        if (table.pager.in_transaction)
+            return EXECUTE_TRANSACTION_ACTIVE;
+
+        // the memtable is not in any page, write it out so the backup has it
+        if (table.engine == ENGINE_LSM) {
+            lsm_flush_memtable(table);
+            lsm_schedule_compaction(table);
+        }
+
+        snapshot = open_snapshot(table);
+    }
+
+    table.backup_worker = thread(backup_snapshot, ref(table), snapshot, path);
+    return EXECUTE_SUCCESS;
+}
 
-    return static_cast<char*>(row_addr);
+void close_db_conn(Table& table) {
+    Pager& pager = table.pager;
+
+    // let the backup and compaction finish reading the pages before they are freed
+    wait_for_backup(table);
+    wait_for_compaction(table);
+
+    // an open transaction never committed
+    if (pager.in_transaction)
+        rollback_transaction(table, cout);
+
+    if (table.engine == ENGINE_LSM)
+        lsm_flush_memtable(table);
+
+    // flush the database to disk
+    commit_pages(table);
+
+    // close the fd and free up the pages
+    int result = close(pager.file_descriptor);
+    if(result == -1) {
+        cerr << "Error closing file descriptor: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (table.trace)
+        trace_close(*table.trace);
+
+    free_table(table);
 }
 
 /// @brief Prepare the display for taking the input.
@@ -511,27 +2886,54 @@ void display_prompt() {
     cout << PROMPT;
 }
 
-void display_leaf_node(void* node) {
-    // displays the row cells
-    uint32_t num_cells = *get_leaf_node_cells(node);
-    
-    cout << "Page addr: " << static_cast<char*>(node) << ", Total cells: " << num_cells << endl;
-    for(uint32_t i = 0; i < num_cells; i++) {
-        cout << "cell " << i << ": " << " key: " << *get_leaf_node_key(node, i) << " ";
-        
-        if (DEBUG_MODE) {
-            Row row;
-            read_row(get_leaf_node_value(node, i), row);
-            print_row(row);
+void display_node(Pager& pager, uint32_t page_num, uint32_t indent, ostream& out) {
+    void* node = get_page(pager, page_num);
+    string padding(indent * 2, ' ');
+
+    if (get_node_type(node) == LEAF) {
+        uint32_t num_cells = *get_leaf_node_cells(node);
+        out << padding << "- leaf (page " << page_num << ", size " << num_cells << ")" << endl;
+
+        for(uint32_t i = 0; i < num_cells; i++) {
+            out << padding << "  - " << *get_leaf_node_key(node, i) << endl;
+
+            if (DEBUG_MODE) {
+                Row row;
+                read_row(get_leaf_node_value(node, i), row);
+                print_row(row);
+            }
         }
-        cout << endl;
+        return;
+    }
+
+    uint32_t num_keys = *get_internal_node_num_keys(node);
+    out << padding << "- internal (page " << page_num << ", size " << num_keys
+        << ", rows " << get_node_row_count(node) << ")" << endl;
+
+    for(uint32_t i = 0; i <= num_keys; i++) {
+        display_node(pager, *get_internal_node_child(node, i), indent + 1, out);
+
+        if (i < num_keys)
+            out << padding << "  - key " << *get_internal_node_key(node, i) << endl;
+    }
+}
+
+void display_lsm(Table& table, ostream& out) {
+    out << "- memtable (size " << table.lsm.memtable.size() << ")" << endl;
+
+    for(LsmRun& run: table.lsm.runs) {
+        out << "- run (pages " << run.pages.size() << ", rows " << run.num_rows
+            << ", keys " << run.min_key << ".." << run.max_key << ")" << endl;
     }
 }
 
-void init_db_info() {
+void init_db_info(Table& table) {
     if (DEBUG_MODE) {
-        cout << "TABLE_MAX_ROWS: " << TABLE_MAX_ROWS << ", ROW_SIZE: " << ROW_SIZE << endl;
-        cout << "TABLE_MAX_PAGES: " << TABLE_MAX_PAGES << ", PAGE_SIZE: " << PAGE_SIZE << ", ROWS_PER_PAGE: " << ROWS_PER_PAGE << endl;
+        uint32_t page_size = table.pager.page_size;
+        cout << "TABLE_MAX_ROWS: " << table_max_rows(page_size) << ", ROW_SIZE: " << ROW_SIZE << endl;
+        cout << "TABLE_MAX_PAGES: " << TABLE_MAX_PAGES << ", PAGE_SIZE: " << page_size << ", ROWS_PER_PAGE: " << rows_per_page(page_size) << endl;
+        cout << "DIRECT_IO: " << table.pager.direct_io << ", ARENA_SIZE: " << table.pager.arena_size << endl;
+        cout << "ENGINE: " << (table.engine == ENGINE_LSM ? "lsm" : "btree") << ", COMPRESSED: " << table.pager.compressed << endl;
     
         cout << "BTree info..." << endl;
         cout << "............Common Header............" << endl;
@@ -573,17 +2975,54 @@ InputResult read_input(InputBuffer& input_buffer) {
     return InputResult::INVALID_INPUT;
 }
 
-MetaCommandResult run_metacommand(string& cmd, Table& table) {
+const string SESSION_LOCKED_ERROR = "[ERROR] Database is locked by another session's transaction";
+
+MetaCommandResult run_metacommand(string& cmd, Table& table, uint32_t session_id, ostream& out) {
+    // ends the session, the caller decides what that means
     if (cmd == ".exit") {
-        cout << "Encountered exit, exiting..." << endl;
-        close_db_conn(table);
-        exit(EXIT_SUCCESS);
+        return MetaCommandResult::META_COMMAND_EXIT;
     }
     else if(cmd == ".btree") {
-        cout << "Printing B+ Tree..." << endl;
-        display_leaf_node(get_page(table.pager, table.root_page_num));
+        lock_guard<mutex> guard(*table.lock);
+        record_input(table, session_id, cmd);
+
+        // same as a select, the open transaction is not visible to the others
+        if (locked_by_other_session(table, session_id)) {
+            out << SESSION_LOCKED_ERROR << endl;
+            return MetaCommandResult::META_COMMAND_FAILURE;
+        }
+
+        if (table.engine == ENGINE_LSM) {
+            out << "Printing LSM runs..." << endl;
+            display_lsm(table, out);
+            return MetaCommandResult::META_COMMAND_SUCCESS;
+        }
+
+        out << "Printing B+ Tree..." << endl;
+        display_node(table.pager, table.root_page_num, 0, out);
         return MetaCommandResult::META_COMMAND_SUCCESS;
     }
+    else if(cmd.substr(0, 8) == ".backup ") {
+        // Syntax: .backup <path>
+        string path = cmd.substr(8);
+        if (path.empty() || path == table.filename) {
+            record_input(table, session_id, cmd);
+            out << "Invalid backup path: " << path << endl;
+            return MetaCommandResult::META_COMMAND_FAILURE;
+        }
+
+        switch (start_backup(table, path, session_id, cmd)) {
+            case EXECUTE_SUCCESS:
+                out << "Backup started: " << path << endl;
+                return MetaCommandResult::META_COMMAND_SUCCESS;
+            case EXECUTE_LOCKED:
+                out << SESSION_LOCKED_ERROR << endl;
+                return MetaCommandResult::META_COMMAND_FAILURE;
+            default:
+                out << "Cannot back up inside a transaction, commit or rollback first" << endl;
+                return MetaCommandResult::META_COMMAND_FAILURE;
+        }
+    }
     else {
         return MetaCommandResult::META_COMMAND_UNRECOGNIZED;
     }
@@ -602,6 +3041,25 @@ vector<string> tokenize_string(string& str, char delimiter = ' ') {
     return tokens;
 }
 
+/// @brief Parses a non negative integer token which has to fit in a key.
+StatementPrepareState parse_key_token(string& token, uint32_t& value) {
+    if (token.empty())
+        return PREPARE_NULL_TOKEN;
+
+    if (token[0] == '-')
+        return PREPARE_TOKEN_NEGATIVE;
+
+    if (token.find_first_not_of("0123456789") != string::npos || token.size() > 10)
+        return PREPARE_INVALID_SYNTAX;
+
+    unsigned long long number = stoull(token);
+    if (number > UINT32_MAX)
+        return PREPARE_INVALID_SYNTAX;
+
+    value = number;
+    return PREPARE_SUCCESS;
+}
+
 pair<StatementPrepareState, Statement> prepare_insert(string& cmd) {
     Statement statement;
 
@@ -622,11 +3080,13 @@ pair<StatementPrepareState, Statement> prepare_insert(string& cmd) {
         return { PREPARE_TOKEN_TOO_LONG, statement };
     }
     
-    statement.row.id = stoll(tokens[1]);
-
-    if (statement.row.id < 0) {
-        return { PREPARE_TOKEN_NEGATIVE, statement };
+    // the id is the key, same range as the keys of a select
+    uint32_t id;
+    StatementPrepareState id_state = parse_key_token(tokens[1], id);
+    if (id_state != PREPARE_SUCCESS) {
+        return { id_state, statement };
     }
+    statement.row.id = id;
 
     strncpy(statement.row.username, tokens[2].c_str(), USERNAME_LENGTH);
     strncpy(statement.row.email, tokens[3].c_str(), EMAIL_LENGTH);
@@ -641,6 +3101,64 @@ pair<StatementPrepareState, Statement> prepare_insert(string& cmd) {
     return { PREPARE_SUCCESS, statement };
 }
 
+pair<StatementPrepareState, Statement> prepare_select(string& cmd) {
+    Statement statement;
+    statement.statement_command = STATEMENT_SELECT;
+    SelectQuery& query = statement.select;
+
+    vector<string> tokens = tokenize_string(cmd, ' ');
+
+    // Syntax: select [count(*)] [where id between <start> and <end>] [limit <n>] [offset <m>]
+    if (tokens.empty() || tokens[0] != "select") {
+        return { PREPARE_UNRECOGNIZED, statement };
+    }
+
+    for(string token: tokens) {
+        if (token.empty()) {
+            return { PREPARE_NULL_TOKEN, statement };
+        }
+    }
+
+    size_t i = 1;
+    if (i < tokens.size() && tokens[i] == "count(*)") {
+        query.count = true;
+        i++;
+    }
+
+    if (i < tokens.size() && tokens[i] == "where") {
+        if (i + 5 >= tokens.size() || tokens[i + 1] != "id" ||
+                tokens[i + 2] != "between" || tokens[i + 4] != "and") {
+            return { PREPARE_INVALID_SYNTAX, statement };
+        }
+
+        StatementPrepareState state = parse_key_token(tokens[i + 3], query.range_start);
+        if (state == PREPARE_SUCCESS)
+            state = parse_key_token(tokens[i + 5], query.range_end);
+        if (state != PREPARE_SUCCESS) {
+            return { state, statement };
+        }
+
+        query.has_range = true;
+        i += 6;
+    }
+
+    while (i < tokens.size()) {
+        if (i + 1 >= tokens.size() || (tokens[i] != "limit" && tokens[i] != "offset")) {
+            return { PREPARE_INVALID_SYNTAX, statement };
+        }
+
+        uint32_t& value = tokens[i] == "limit" ? query.limit : query.offset;
+        StatementPrepareState state = parse_key_token(tokens[i + 1], value);
+        if (state != PREPARE_SUCCESS) {
+            return { state, statement };
+        }
+
+        i += 2;
+    }
+
+    return { PREPARE_SUCCESS, statement };
+}
+
 pair<StatementPrepareState, Statement> prepare_statement_command(string& cmd) {
     Statement statement;
 
@@ -648,13 +3166,23 @@ pair<StatementPrepareState, Statement> prepare_statement_command(string& cmd) {
     if (cmd.substr(0, 6) == "insert") {
         return prepare_insert(cmd);
     }
-    else if (cmd == "select") {
-        // Syntax: select
-        statement.statement_command = STATEMENT_SELECT;
+    else if (cmd.substr(0, 6) == "select") {
+        return prepare_select(cmd);
+    }
+    else if (cmd == "delete")
+        return { PREPARE_SUCCESS, statement };
+    else if (cmd == "begin") {
+        statement.statement_command = STATEMENT_BEGIN;
         return { PREPARE_SUCCESS, statement };
     }
-    else if (cmd == "delete")
+    else if (cmd == "commit") {
+        statement.statement_command = STATEMENT_COMMIT;
+        return { PREPARE_SUCCESS, statement };
+    }
+    else if (cmd == "rollback") {
+        statement.statement_command = STATEMENT_ROLLBACK;
         return { PREPARE_SUCCESS, statement };
+    }
     else
         return { PREPARE_UNRECOGNIZED, statement };
 }
@@ -663,11 +3191,12 @@ void* get_row_slot(int32_t row_num, Table& table) {
     // NOTE: For now, we take the row index (0 indexed) as the
     // next row after the last inserted row
     // page_idx is again 0 indexed
-    int32_t page_idx = row_num / ROWS_PER_PAGE;
+    uint32_t num_rows_per_page = rows_per_page(table.pager.page_size);
+    int32_t page_idx = row_num / num_rows_per_page;
 
     void* page = get_page(table.pager, page_idx);
 
-    uint32_t row_offset = row_num % ROWS_PER_PAGE;
+    uint32_t row_offset = row_num % num_rows_per_page;
     uint32_t byte_offset = row_offset * ROW_SIZE;
 
     // NOTE: Ptr arithmetic doesnt work on void*, since char* is 1 byte, we cast it to char*
@@ -679,65 +3208,256 @@ void* get_row_slot(int32_t row_num, Table& table) {
     return row_addr;
 }
 
-ExecuteResult execute_insert(Statement& statement, Table& table) {
-    void* node = get_page(table.pager, table.root_page_num);
+ExecuteResult execute_insert(Statement& statement, Table& table, ostream& out) {
+    Row& row = statement.row;
+    uint32_t key = row.id;
 
-    if (*get_leaf_node_cells(node) >= LEAF_NODE_MAX_CELLS) {
-        return EXECUTE_TABLE_FULL;
+    if (table.engine == ENGINE_LSM) {
+        ExecuteResult result = lsm_insert(table, row);
+        if (result == EXECUTE_SUCCESS)
+            out << "Row inserted successfully." << endl;
+        return result;
     }
 
-    // row is inserted at the end of table
-    Cursor cursor = table_end(table);
+    // rows are kept sorted by id, find where this one goes
+    Cursor cursor = table_find(table, key);
+    void* node = get_page(table.pager, cursor.page_num);
+    uint32_t num_cells = *get_leaf_node_cells(node);
 
-    Row row = statement.row;
-    void* row_addr = insert_leaf_node(cursor, row.id, row);
-    ++table.num_rows;
+    if (cursor.cell_num < num_cells && *get_leaf_node_key(node, cursor.cell_num) == key) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
 
-    if (DEBUG_MODE) {
-        Row row;
-        read_row(row_addr, row);
+    if (num_cells >= leaf_node_max_cells(table.pager.page_size) && !leaf_node_can_split(table, node)) {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    leaf_node_insert(cursor, key, row);
+
+    if (DEBUG_MODE)
         cout <<"[INSERT] Id: " << row.id << " " << row.username << " " << row.email << endl;
+
+    out << "Row inserted successfully." << endl;
+    return EXECUTE_SUCCESS;
+}
+
+/// @brief Select by walking the rows of the snapshot in key order, for the LSM
+/// engine which has no subtree row counts to skip over rows with.
+ExecuteResult execute_select_scan(Statement& statement, Table& table, Snapshot* snapshot, ostream& out) {
+    SelectQuery& query = statement.select;
+    Row row;
+    uint32_t num_rows = 0, skipped_rows = 0;
+
+    Cursor cursor = lsm_seek(table, query.has_range ? query.range_start : 0, snapshot);
+    for(; !cursor.end_of_table; cursor_next(cursor)) {
+        if (query.has_range && get_cursor_key(cursor) > query.range_end)
+            break;
+
+        if (query.count) {
+            num_rows++;
+            continue;
+        }
+
+        if (skipped_rows < query.offset) {
+            skipped_rows++;
+            continue;
+        }
+
+        if (num_rows >= query.limit)
+            break;
+
+        read_row(get_cursor_value_addr(cursor), row);
+        num_rows++;
+
+        out <<"[SELECT] (" << row.id << " " << row.username << " " << row.email << ")" << endl;
     }
 
-    cout << "Row inserted successfully." << endl;
+    if (query.count)
+        out << "[COUNT] (" << num_rows << ")" << endl;
+    else
+        out << "Returned " << num_rows << " rows." << endl;
     return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select_all(Table& table) {
+/// @brief Called with the table lock held (see execute_statement). The rows
+/// are read through a snapshot with the lock released, so a long select does
+/// not hold off inserts.
+ExecuteResult execute_select(Statement& statement, Table& table, unique_lock<mutex>& guard, ostream& out) {
+    SelectQuery& query = statement.select;
     Row row;
 
-    // Get the cursor to the beginning of table
-    Cursor cursor = table_begin(table);
-    while(!cursor.end_of_table) {
+    if (table.engine == ENGINE_LSM) {
+        Snapshot* snapshot = open_snapshot(table);
+        guard.unlock();
+        ExecuteResult result = execute_select_scan(statement, table, snapshot, out);
+
+        guard.lock();
+        release_snapshot(table, snapshot);
+        return result;
+    }
+
+    // The rows to return are a contiguous range of ranks [start_rank, end_rank),
+    // with the subtree row counts both ends are found without a scan.
+    uint32_t start_rank = 0;
+    uint32_t end_rank = table_row_count(table);
+
+    if (query.has_range) {
+        start_rank = table_rank(table, query.range_start);
+        if (query.range_end < UINT32_MAX)
+            end_rank = table_rank(table, query.range_end + 1);
+
+        end_rank = max(start_rank, end_rank);
+    }
+
+    if (query.count) {
+        out << "[COUNT] (" << end_rank - start_rank << ")" << endl;
+        return EXECUTE_SUCCESS;
+    }
+
+    uint32_t first_rank = start_rank + min(query.offset, end_rank - start_rank);
+    uint32_t last_rank = end_rank;
+    if (query.limit < last_rank - first_rank)
+        last_rank = first_rank + query.limit;
+
+    // the ranks were found under the lock, the snapshot sees the same rows
+    Snapshot* snapshot = open_snapshot(table);
+    guard.unlock();
+
+    // Get the cursor to the first row to return
+    Cursor cursor = table_at_rank(table, first_rank, snapshot);
+    for(uint32_t rank = first_rank; rank < last_rank && !cursor.end_of_table; rank++) {
         void* cursor_addr = get_cursor_value_addr(cursor);
         read_row(cursor_addr, row);
         cursor_next(cursor);
 
-        cout <<"[SELECT] (" << row.id << " " << row.username << " " << row.email << ")" << endl;
+        out <<"[SELECT] (" << row.id << " " << row.username << " " << row.email << ")" << endl;
     }
 
-    cout << "Returned " << table.num_rows << " rows." << endl;
+    guard.lock();
+    release_snapshot(table, snapshot);
+
+    out << "Returned " << last_rank - first_rank << " rows." << endl;
     return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_statement(Statement statement, Table& table) {
-    
+/// @brief Runs the statement on behalf of a session (a server client, or the
+/// repl). While a session has a transaction open, the other sessions can
+/// neither see nor modify the table.
+ExecuteResult execute_statement(string& input, Statement statement, Table& table, uint32_t session_id, ostream& out) {
+    unique_lock<mutex> guard(*table.lock);
+    record_input(table, session_id, input);
+
+    if (locked_by_other_session(table, session_id))
+        return EXECUTE_LOCKED;
+
     switch (statement.statement_command) {
         case STATEMENT_INSERT:
-            return execute_insert(statement, table);
+            return execute_insert(statement, table, out);
         case STATEMENT_SELECT:
-            return execute_select_all(table);
+            return execute_select(statement, table, guard, out);
         case STATEMENT_DELETE:
             return EXECUTE_SUCCESS;
+        case STATEMENT_BEGIN:
+            return begin_transaction(table, session_id, out);
+        case STATEMENT_COMMIT:
+            return commit_transaction(table, out);
+        case STATEMENT_ROLLBACK:
+            return rollback_transaction(table, out);
     }
 
     return EXECUTE_FAILURE;
 }
 
-void repl_loop(string filename) {
+/// @brief Runs one line of input, a meta command or a statement, and writes
+/// the results to out. The caller ends the session on PROCESS_INPUT_EXIT.
+ProcessInputResult process_input(string& input, Table& table, uint32_t session_id, ostream& out) {
+    if (input.size() == 0) {
+        out << "Empty input, please try again." << endl;
+        return PROCESS_INPUT_FAILURE;
+    }
+
+    if (DEBUG_MODE)
+        cout << "Input: " << input << ", size: " << input.size() << endl;
+
+    // Lines that run against the table are recorded under the table lock by
+    // execute_statement and run_metacommand, the end of a session by whoever
+    // ends it (see end_session). The rejected lines are recorded here.
+
+    // Handle meta commands, meta commands start with a '.' character
+    if (input[0] == '.') {
+        switch (run_metacommand(input, table, session_id, out)) {
+            case MetaCommandResult::META_COMMAND_SUCCESS:
+                return PROCESS_INPUT_SUCCESS;
+            case MetaCommandResult::META_COMMAND_FAILURE:
+                return PROCESS_INPUT_FAILURE;
+            case MetaCommandResult::META_COMMAND_EXIT:
+                return PROCESS_INPUT_EXIT;
+            case MetaCommandResult::META_COMMAND_UNRECOGNIZED:
+                record_input(table, session_id, input);
+                out << "Unrecognized command: " << input << endl;
+                return PROCESS_INPUT_FAILURE;
+        }
+    }
+    
+    // Prepare the statement commands which can then be executed
+    // Here the idea is to convert the string to a more code friendly semantic
+    // Eg converting "insert" to StatementCommand::STATEMENT_INSERT
+    auto [prepare_state, statement] = prepare_statement_command(input);
+
+    if (prepare_state != PREPARE_SUCCESS)
+        record_input(table, session_id, input);
+
+    switch (prepare_state) {
+        case PREPARE_SUCCESS:
+            break;
+        case PREPARE_INVALID_SYNTAX:
+            out << "Invalid Syntax: " << input << endl;
+            return PROCESS_INPUT_FAILURE;
+        case PREPARE_TOKEN_TOO_LONG:
+            out << "Token too long: " << input << endl;
+            return PROCESS_INPUT_FAILURE;
+        case PREPARE_NULL_TOKEN:
+            out << "Null token found: " << input << endl;
+            return PROCESS_INPUT_FAILURE;
+        case PREPARE_TOKEN_NEGATIVE:
+            out << "Negative token found: " << input << endl;
+            return PROCESS_INPUT_FAILURE;
+        case PREPARE_UNRECOGNIZED:
+            out << "Unrecognized statement: " << input << endl;
+            return PROCESS_INPUT_FAILURE;
+    }
+
+    // Once the statement preparation is completed, execute it
+    switch(execute_statement(input, statement, table, session_id, out)) {
+        case EXECUTE_SUCCESS:
+            return PROCESS_INPUT_SUCCESS;
+        case EXECUTE_TABLE_FULL:
+            out << "[ERROR] Table is full, cannot insert the row" << endl;
+            break;
+        case EXECUTE_DUPLICATE_KEY:
+            out << "[ERROR] Duplicate key, cannot insert the row" << endl;
+            break;
+        case EXECUTE_TRANSACTION_ACTIVE:
+            out << "[ERROR] A transaction is already open" << endl;
+            break;
+        case EXECUTE_NO_TRANSACTION:
+            out << "[ERROR] No transaction is open" << endl;
+            break;
+        case EXECUTE_LOCKED:
+            out << SESSION_LOCKED_ERROR << endl;
+            break;
+        case EXECUTE_FAILURE:
+            out << "[ERROR] Statement failed: " << input << endl;
+            break;
+    }
+
+    return PROCESS_INPUT_FAILURE;
+}
+
+void repl_loop(DbOptions& options) {
     InputBuffer input_buffer;
-    Table table = open_db_conn(filename);
-    init_db_info();
+    Table table = open_db_conn(options);
+    init_db_info(table);
 
     while (true) {
         display_prompt();
@@ -751,70 +3471,518 @@ void repl_loop(string filename) {
             exit(EXIT_FAILURE);
         }
 
-        if (input_buffer.buffer.size() == 0) {
-            cout << "Empty input, please try again." << endl;
-            continue;
+        if (process_input(input_buffer.buffer, table, REPL_SESSION_ID, cout) == PROCESS_INPUT_EXIT) {
+            cout << "Encountered exit, exiting..." << endl;
+            close_db_conn(table);
+            exit(EXIT_SUCCESS);
         }
+    }
+  
+    free_table(table);
+}
 
-        if (DEBUG_MODE)
-            cout << "Input: " << input_buffer.buffer << ", size: " << input_buffer.input_size << endl;
-        
-        // Handle meta commands, meta commands start with a '.' character
-        if (input_buffer.buffer[0] == '.') {
-            switch (run_metacommand(input_buffer.buffer, table)) {
-                case MetaCommandResult::META_COMMAND_SUCCESS:
-                    continue;
-                case MetaCommandResult::META_COMMAND_UNRECOGNIZED:
-                    cout << "Unrecognized command: " << input_buffer.buffer << endl;
-                    continue;
-            }
-        }
-        
-        // Prepare the statement commands which can then be executed
-        // Here the idea is to convert the string to a more code friendly semantic
-        // Eg converting "insert" to StatementCommand::STATEMENT_INSERT
-        auto [prepare_state, statement] = prepare_statement_command(input_buffer.buffer);
+/*
+*   Server mode: one process owns the table and serves local clients over a
+*   unix socket. The epoll loop only accepts and waits, the statements run
+*   on a pool of workers.
+*/
+const uint32_t SERVER_READ_SIZE = 64 * 1024;
+const uint32_t SERVER_DEFAULT_WORKERS = 4;
+const int SERVER_MAX_EVENTS = 64;
+
+/// @brief A client of the server. The connection is registered with
+/// EPOLLONESHOT, so at most one worker handles it at a time and its
+/// statements run in the order they were sent.
+struct Connection {
+    int fd;
+    uint32_t session_id;
+    string input;  // received bytes after the last complete line
+    string output; // responses not written out yet
+    bool closing;  // .exit or end of input, closed once the output is written
+};
+
+struct Server {
+    Table* table;
+    string path;
+    int listen_fd;
+    int signal_fd;
+    int epoll_fd;
+    uint32_t next_session_id;
+
+    // connections with events to handle, in the order they became ready
+    mutex queue_lock;
+    condition_variable queue_ready;
+    deque<Connection*> queue;
+    bool stopping;
+    vector<thread> workers;
+
+    // open connections, closed by whichever worker sees the client go
+    mutex connections_lock;
+    set<Connection*> connections;
+};
+
+void server_watch(Server& server, Connection* conn, uint32_t events) {
+    epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = conn;
+
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        cerr << "Failed to watch client " << conn->session_id << ", errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+}
 
-        switch (prepare_state) {
-            case PREPARE_SUCCESS:
+/// @brief Closes the connection, a transaction the client left open is rolled back.
+void server_close_connection(Server& server, Connection* conn) {
+    end_session(*server.table, conn->session_id);
+
+    {
+        lock_guard<mutex> guard(server.connections_lock);
+        server.connections.erase(conn);
+    }
+
+    close(conn->fd);
+
+    if (DEBUG_MODE)
+        cout << "Client disconnected: session " << conn->session_id << endl;
+    delete conn;
+}
+
+/// @brief Writes out as much of the pending output as the socket takes.
+/// Returns false if the client is gone.
+bool server_write_output(Connection* conn) {
+    size_t written = 0;
+
+    while (written < conn->output.size()) {
+        ssize_t bytes = send(conn->fd, conn->output.data() + written,
+            conn->output.size() - written, MSG_NOSIGNAL);
+
+        if (bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
                 break;
-            case PREPARE_INVALID_SYNTAX:
-                cout << "Invalid Syntax: " << input_buffer.buffer << endl;
+            if (errno == EINTR)
                 continue;
-            case PREPARE_TOKEN_TOO_LONG:
-                cout << "Token too long: " << input_buffer.buffer << endl;
+            return false;
+        }
+
+        written += bytes;
+    }
+
+    conn->output.erase(0, written);
+    return true;
+}
+
+/// @brief Handles a ready connection: reads everything the client sent so
+/// far, runs every complete line in order and answers them with a single
+/// write. Each response ends with an empty line.
+void server_handle_connection(Server& server, Connection* conn) {
+    // the output of the previous batch has to go out before new input is taken
+    if (!conn->output.empty()) {
+        if (!server_write_output(conn)) {
+            server_close_connection(server, conn);
+            return;
+        }
+
+        if (!conn->output.empty()) {
+            server_watch(server, conn, EPOLLOUT);
+            return;
+        }
+    }
+
+    if (!conn->closing) {
+        char buffer[SERVER_READ_SIZE];
+
+        while (true) {
+            ssize_t bytes = recv(conn->fd, buffer, sizeof(buffer), 0);
+
+            if (bytes > 0) {
+                conn->input.append(buffer, bytes);
                 continue;
-            case PREPARE_NULL_TOKEN:
-                cout << "Null token found: " << input_buffer.buffer << endl;
+            }
+
+            if (bytes == -1 && errno == EINTR)
                 continue;
-            case PREPARE_TOKEN_NEGATIVE:
-                cout << "Negative token found: " << input_buffer.buffer << endl;
+            if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                conn->closing = true;
+            break;
+        }
+
+        ostringstream out;
+        size_t line_start = 0, line_end;
+
+        while ((line_end = conn->input.find('\n', line_start)) != string::npos) {
+            string line = conn->input.substr(line_start, line_end - line_start);
+            line_start = line_end + 1;
+
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            if (process_input(line, *server.table, conn->session_id, out) == PROCESS_INPUT_EXIT) {
+                conn->closing = true;
+                break;
+            }
+
+            out << endl;
+        }
+
+        conn->input.erase(0, line_start);
+        conn->output += out.str();
+
+        if (!server_write_output(conn)) {
+            server_close_connection(server, conn);
+            return;
+        }
+    }
+
+    if (!conn->output.empty())
+        server_watch(server, conn, EPOLLOUT);
+    else if (conn->closing)
+        server_close_connection(server, conn);
+    else
+        server_watch(server, conn, EPOLLIN);
+}
+
+void server_worker(Server& server) {
+    while (true) {
+        Connection* conn;
+        {
+            unique_lock<mutex> guard(server.queue_lock);
+            server.queue_ready.wait(guard, [&server] { return server.stopping || !server.queue.empty(); });
+
+            if (server.stopping)
+                return;
+
+            conn = server.queue.front();
+            server.queue.pop_front();
+        }
+
+        server_handle_connection(server, conn);
+    }
+}
+
+void server_accept(Server& server) {
+    while (true) {
+        int fd = accept4(server.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                cerr << "Failed to accept a client, errno: " << errno << endl;
+            if (errno == EINTR)
                 continue;
-            case PREPARE_UNRECOGNIZED:
-                cout << "Unrecognized statement: " << input_buffer.buffer << endl;
+            return;
+        }
+
+        Connection* conn = new Connection{ fd, server.next_session_id++, "", "", false };
+        {
+            lock_guard<mutex> guard(server.connections_lock);
+            server.connections.insert(conn);
+        }
+
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            cerr << "Failed to watch client " << conn->session_id << ", errno: " << errno << endl;
+            server_close_connection(server, conn);
+            continue;
+        }
+
+        if (DEBUG_MODE)
+            cout << "Client connected: session " << conn->session_id << endl;
+    }
+}
+
+int server_listen(string& path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path too long: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        cerr << "Failed to create socket, errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // a socket file left behind by a previous server that did not shut down
+    unlink(path.c_str());
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        cerr << "Unable to listen on " << path << ", errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/// @brief Serves clients until SIGINT or SIGTERM, then closes the database
+/// like .exit does in the repl.
+void serve(DbOptions& options) {
+    // Block the shutdown signals before any thread starts so that they all
+    // inherit the mask, the signals are read from a signalfd instead.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    // a client (or whoever reads our output) going away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    Table table = open_db_conn(options);
+    init_db_info(table);
+
+    Server server;
+    server.table = &table;
+    server.path = options.serve_path;
+    server.listen_fd = server_listen(server.path);
+    server.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.next_session_id = REPL_SESSION_ID + 1;
+    server.stopping = false;
+
+    if (server.signal_fd == -1 || server.epoll_fd == -1) {
+        cerr << "Failed to set up the server, errno: " << errno << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // the listening socket and the signals are told apart from the clients by address
+    Connection listener{ server.listen_fd, 0, "", "", false };
+    Connection stop_signal{ server.signal_fd, 0, "", "", false };
+    for(Connection* source: { &listener, &stop_signal }) {
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = source;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, source->fd, &event);
+    }
+
+    uint32_t num_workers = thread::hardware_concurrency();
+    if (num_workers == 0)
+        num_workers = SERVER_DEFAULT_WORKERS;
+    for(uint32_t i = 0; i < num_workers; i++)
+        server.workers.emplace_back(server_worker, ref(server));
+
+    cout << "Listening on " << server.path << ", workers: " << num_workers << endl;
+
+    epoll_event events[SERVER_MAX_EVENTS];
+    bool running = true;
+
+    while (running) {
+        int num_events = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+
+        if (num_events == -1) {
+            if (errno == EINTR)
                 continue;
+            cerr << "epoll_wait failed, errno: " << errno << endl;
+            exit(EXIT_FAILURE);
         }
 
-        // Once the statement preparation is completed, execute it
-        switch(execute_statement(statement, table)) {
-            case EXECUTE_SUCCESS:
-                break;
-            case EXECUTE_TABLE_FULL:
-                cout << "[ERROR] Table is full, cannot insert the row" << endl;
-                break;
+        for(int i = 0; i < num_events; i++) {
+            Connection* source = static_cast<Connection*>(events[i].data.ptr);
+
+            if (source == &listener) {
+                server_accept(server);
+            }
+            else if (source == &stop_signal) {
+                running = false;
+            }
+            else {
+                lock_guard<mutex> guard(server.queue_lock);
+                server.queue.push_back(source);
+                server.queue_ready.notify_one();
+            }
         }
     }
-  
-    free_table(table);
+
+    cout << "Shutting down..." << endl;
+
+    {
+        lock_guard<mutex> guard(server.queue_lock);
+        server.stopping = true;
+        server.queue_ready.notify_all();
+    }
+    for(thread& worker: server.workers)
+        worker.join();
+
+    for(Connection* conn: vector<Connection*>(server.connections.begin(), server.connections.end()))
+        server_close_connection(server, conn);
+
+    close(server.listen_fd);
+    close(server.signal_fd);
+    close(server.epoll_fd);
+    unlink(server.path.c_str());
+
+    close_db_conn(table);
+}
+
+/*
+*   Replay of a --record trace: the inputs run one at a time in the order
+*   they were recorded, each in the session it came from.
+*/
+struct TraceRecord {
+    uint64_t time; // microseconds since the start of the trace
+    uint32_t session_id;
+    string line;
+};
+
+vector<TraceRecord> read_trace(string& path) {
+    ifstream file(path, ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    if (!file.good() && !file.eof()) {
+        cerr << "Unable to read trace file: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (data.size() < TRACE_MAGIC_SIZE || memcmp(data.data(), TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        cerr << "Unrecognized trace file format: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    vector<TraceRecord> records;
+    size_t pos = TRACE_MAGIC_SIZE;
+    uint64_t time = 0;
+
+    while (pos < data.size()) {
+        uint64_t delta, session_id, length;
+
+        if (!trace_read_varint(data, pos, delta) || !trace_read_varint(data, pos, session_id) ||
+            !trace_read_varint(data, pos, length) || length > data.size() - pos) {
+            // a trace cut short (eg the recording process was killed), keep what is complete
+            cout << "[WRN] Truncated trace record at byte " << pos << ", ignoring the rest" << endl;
+            break;
+        }
+
+        time += delta;
+        records.push_back({ time, static_cast<uint32_t>(session_id), data.substr(pos, length) });
+        pos += length;
+    }
+
+    return records;
+}
+
+/// @brief Nearest rank percentile of sorted latencies, in microseconds.
+double latency_percentile(vector<uint64_t>& sorted_ns, double percentile) {
+    if (sorted_ns.empty())
+        return 0;
+
+    // the smallest latency with at least percentile % of them at or below it
+    double rank = ceil(percentile * sorted_ns.size() / 100) - 1;
+    size_t index = static_cast<size_t>(max(0.0, rank));
+    return sorted_ns[min(index, sorted_ns.size() - 1)] / 1000.0;
+}
+
+void replay(DbOptions& options) {
+    vector<TraceRecord> records = read_trace(options.replay_path);
+
+    Table table = open_db_conn(options);
+    init_db_info(table);
+
+    // latencies in nanoseconds, overall and by the first word of the input
+    vector<uint64_t> latencies;
+    map<string, vector<uint64_t>> latencies_by_kind;
+    uint32_t num_errors = 0;
+
+    auto start = chrono::steady_clock::now();
+
+    for(TraceRecord& record: records) {
+        if (options.replay_paced)
+            this_thread::sleep_until(start + chrono::microseconds(record.time));
+
+        // recorded when a client went away
+        if (record.line == ".exit") {
+            end_session(table, record.session_id);
+            continue;
+        }
+
+        ostringstream out;
+        auto begin = chrono::steady_clock::now();
+        ProcessInputResult result = process_input(record.line, table, record.session_id, out);
+        auto end = chrono::steady_clock::now();
+
+        uint64_t latency = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+        latencies.push_back(latency);
+        latencies_by_kind[record.line.substr(0, record.line.find(' '))].push_back(latency);
+
+        if (result == PROCESS_INPUT_FAILURE)
+            num_errors++;
+    }
+
+    auto close_start = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(close_start - start).count();
+
+    // flushing the changes is part of the workload as well
+    close_db_conn(table);
+    double close_elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - close_start).count();
+
+    sort(latencies.begin(), latencies.end());
+    cout << fixed << setprecision(1);
+    cout << "Replayed " << latencies.size() << " inputs from " << options.replay_path << " in "
+        << elapsed * 1000 << " ms (" << (elapsed > 0 ? latencies.size() / elapsed : 0) << " inputs/s), errors: "
+        << num_errors << endl;
+    cout << "Latency (us): p50 " << latency_percentile(latencies, 50) << ", p90 " << latency_percentile(latencies, 90)
+        << ", p99 " << latency_percentile(latencies, 99) << ", p99.9 " << latency_percentile(latencies, 99.9)
+        << ", max " << (latencies.empty() ? 0 : latencies.back() / 1000.0) << endl;
+
+    for(auto& [kind, kind_latencies]: latencies_by_kind) {
+        sort(kind_latencies.begin(), kind_latencies.end());
+        cout << "  " << kind << ": " << kind_latencies.size() << " inputs, p50 " << latency_percentile(kind_latencies, 50)
+            << ", p99 " << latency_percentile(kind_latencies, 99) << endl;
+    }
+
+    cout << "Close: " << close_elapsed << " ms" << endl;
+
+    PagerStats& stats = table.pager.stats;
+    cout << "Pager: page hits " << stats.page_hits << ", page misses " << stats.page_misses
+        << ", bytes read " << stats.bytes_read << ", pages written " << stats.pages_written
+        << ", bytes written " << stats.bytes_written << ", journal bytes " << stats.journal_bytes
+        << ", syncs " << stats.syncs << endl;
+}
+
+const string USAGE =
+    "Usage: db <db_filename> [--debug] [--page-size <4K-64K>] [--direct-io] [--huge-pages] [--engine <btree|lsm>] [--compress] [--serve <socket_path>]"
+    " [--record <trace_file>] [--replay <trace_file> [--paced]]";
+
+/// @brief Parses a page size given either in bytes or in KB with a K suffix.
+/// Returns 0 if it is not a valid page size.
+uint32_t parse_page_size(string& arg) {
+    uint32_t multiplier = 1;
+    string digits = arg;
+
+    if (!digits.empty() && (digits.back() == 'K' || digits.back() == 'k')) {
+        multiplier = 1024;
+        digits.pop_back();
+    }
+
+    if (digits.empty() || digits.find_first_not_of("0123456789") != string::npos)
+        return 0;
+
+    // anything longer is way past MAX_PAGE_SIZE, and could overflow the parse
+    if (digits.size() > 9)
+        return 0;
+
+    // validated before narrowing, so a huge value cannot wrap to a valid one
+    uint64_t page_size = stoull(digits) * multiplier;
+    if (page_size > MAX_PAGE_SIZE)
+        return 0;
+
+    return is_valid_page_size(static_cast<uint32_t>(page_size)) ? page_size : 0;
 }
 
-string parse_main_args(int argc, char** argv) {
+DbOptions parse_main_args(int argc, char** argv) {
     if (argc < 2) {
-        cerr << "Usage: db <db_filename> [--debug]" << endl;
+        cerr << USAGE << endl;
         exit(EXIT_FAILURE);
     }
 
-    string filename = argv[1];
+    DbOptions options;
+    options.filename = argv[1];
 
     for(int i = 2; i < argc; i++) {
         string arg = argv[i];
@@ -823,14 +3991,82 @@ string parse_main_args(int argc, char** argv) {
             DEBUG_MODE = true;
             cout << "Debug mode enabled." << endl;
         }
+        else if(arg == "--page-size" && i + 1 < argc) {
+            string value = argv[++i];
+            options.page_size = parse_page_size(value);
+
+            if (options.page_size == 0) {
+                cerr << "Invalid page size: " << value << ", expected a power of 2 between 4K and 64K" << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(arg == "--direct-io") {
+            options.direct_io = true;
+        }
+        else if(arg == "--huge-pages") {
+            options.huge_pages = true;
+        }
+        else if(arg == "--compress") {
+            options.compress = true;
+        }
+        else if(arg == "--serve" && i + 1 < argc) {
+            options.serve_path = argv[++i];
+        }
+        else if(arg == "--record" && i + 1 < argc) {
+            options.record_path = argv[++i];
+        }
+        else if(arg == "--replay" && i + 1 < argc) {
+            options.replay_path = argv[++i];
+        }
+        else if(arg == "--paced") {
+            options.replay_paced = true;
+        }
+        else if(arg == "--engine" && i + 1 < argc) {
+            string value = argv[++i];
+
+            if (value == "btree")
+                options.engine = ENGINE_BTREE;
+            else if (value == "lsm")
+                options.engine = ENGINE_LSM;
+            else {
+                cerr << "Invalid engine: " << value << ", expected btree or lsm" << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            cerr << "Unrecognized option: " << arg << endl << USAGE << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!options.replay_path.empty() && !options.serve_path.empty()) {
+        cerr << "--replay and --serve cannot be used together" << endl << USAGE << endl;
+        exit(EXIT_FAILURE);
     }
 
-    return filename;
+    // a replay would record over the trace it reads, or into a second one
+    if (!options.replay_path.empty() && !options.record_path.empty()) {
+        cerr << "--replay and --record cannot be used together" << endl << USAGE << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.replay_paced && options.replay_path.empty()) {
+        cerr << "--paced needs --replay" << endl << USAGE << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return options;
 }
 
 int main(int argc, char** argv) {
-    string filename = parse_main_args(argc, argv);
-    repl_loop(filename);
+    DbOptions options = parse_main_args(argc, argv);
+
+    if (!options.replay_path.empty())
+        replay(options);
+    else if (!options.serve_path.empty())
+        serve(options);
+    else
+        repl_loop(options);
     
     return 0;
 }
\ No newline at end of file
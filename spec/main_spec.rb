@@ -1,3 +1,5 @@
+require 'socket'
+
 describe 'database' do
   def clean_db_file(filename="testdb.db")
     system("make clear file=#{filename}")
@@ -26,9 +28,9 @@ describe 'database' do
       clean_db_file()
   end
 
-  def run_script(commands)
+  def run_script(commands, options="", filename="testdb.db")
     raw_output = nil
-    IO.popen("./db.exe testdb.db", "r+") do |pipe|
+    IO.popen("./db.exe #{filename} #{options}", "r+") do |pipe|
       commands.each do |command|
         pipe.puts command
       end
@@ -158,5 +160,431 @@ describe 'database' do
     ])
 
   end
+
+  it 'Page size chosen at creation is kept when the DB is reopened' do
+    result = run_script([
+      "insert 1 user1 user1@example.com",
+      ".exit",
+    ], "--page-size 16K --direct-io")
+
+    expect(result).to include("> Row inserted successfully.")
+    expect(File.size("testdb.db")).to eq(2 * 16 * 1024)
+
+    # reopened without the option, the size comes from the file header
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+
+    expect(result).to include("> [SELECT] (1 user1 user1@example.com)")
+    expect(File.size("testdb.db")).to eq(2 * 16 * 1024)
+  end
+
+  it 'Invalid page size is rejected' do
+    result = run_script([".exit"], "--page-size 3000 2>&1")
+    expect(result).to include("Invalid page size: 3000, expected a power of 2 between 4K and 64K")
+
+    # too large to parse, and large enough to wrap around to 4K as a uint32_t
+    ["99999999999999999999", "4294971392"].each do |page_size|
+      result = run_script([".exit"], "--page-size #{page_size} 2>&1")
+      expect(result).to include("Invalid page size: #{page_size}, expected a power of 2 between 4K and 64K")
+    end
+  end
+
+  it 'Backup is a consistent image of the DB when it was started' do
+    backup_file = "testdb_backup.db"
+    clean_db_file(backup_file)
+
+    result = run_script([
+      "insert 1 user1 user1@example.com",
+      ".backup #{backup_file}",
+      "insert 2 user2 user2@example.com",
+      ".exit",
+    ])
+
+    expect(result).to include("> Backup started: #{backup_file}")
+
+    # rows inserted after the backup started are not part of it
+    result = run_script([
+      "select",
+      ".exit",
+    ], "", backup_file)
+
+    expect(result).to match_array([
+      "> [SELECT] (1 user1 user1@example.com)",
+      "Returned 1 rows.",
+      "> Encountered exit, exiting..."
+    ])
+
+    clean_db_file(backup_file)
+  end
+
+  it 'Rows are returned in id order across leaf splits' do
+    ids = (1..50).to_a.shuffle(random: Random.new(7))
+    script = ids.map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script << "select"
+    script << ".exit"
+
+    result = run_script(script)
+    selected = result.select { |line| line.include?("[SELECT]") }
+                     .map { |line| line[/\((\d+) /, 1].to_i }
+
+    expect(selected).to eq((1..50).to_a)
+    expect(result).to include("Returned 50 rows.")
+  end
+
+  it 'Counts, ranges and offsets use the subtree row counts' do
+    script = (1..100).map { |i| "insert #{i * 2} user#{i} user#{i}@email.com" }
+    script += [
+      "select count(*)",
+      "select count(*) where id between 11 and 40",
+      "select limit 2 offset 60",
+      "select where id between 7 and 10",
+      ".exit",
+    ]
+
+    result = run_script(script)
+
+    expect(result).to include("> [COUNT] (100)")
+    expect(result).to include("> [COUNT] (15)")
+    expect(result).to include("> [SELECT] (122 user61 user61@email.com)")
+    expect(result).to include("[SELECT] (124 user62 user62@email.com)")
+    expect(result).to include("> [SELECT] (8 user4 user4@email.com)")
+    expect(result).to include("[SELECT] (10 user5 user5@email.com)")
+  end
+
+  it 'Duplicate ids are not allowed' do
+    result = run_script([
+      "insert 1 user1 user1@example.com",
+      "insert 1 user2 user2@example.com",
+      ".exit",
+    ])
+
+    expect(result).to match_array([
+      "> Row inserted successfully.",
+      "> [ERROR] Duplicate key, cannot insert the row",
+      "> Encountered exit, exiting..."
+    ])
+  end
+
+  it 'Ids that do not fit in a key are rejected' do
+    result = run_script([
+      "insert 4294967297 big big@example.com",
+      "insert 4294967295 max max@example.com",
+      "insert 1 one one@example.com",
+      ".exit",
+    ])
+
+    expect(result).to match_array([
+      "> Invalid Syntax: insert 4294967297 big big@example.com",
+      "> Row inserted successfully.",
+      "> Row inserted successfully.",
+      "> Encountered exit, exiting..."
+    ])
+  end
+
+  it 'LSM engine returns rows in id order across runs and compactions' do
+    ids = (1..400).to_a.shuffle(random: Random.new(11))
+    script = ids.map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script << "insert 7 user7 user7@email.com"
+    script << ".exit"
+
+    result = run_script(script, "--engine lsm")
+    expect(result).to include("> [ERROR] Duplicate key, cannot insert the row")
+
+    # the engine is stored in the file, it is not needed on reopen
+    result = run_script([
+      "select",
+      "select count(*) where id between 101 and 200",
+      "select limit 1 offset 299",
+      ".exit",
+    ])
+
+    selected = result.select { |line| line.include?("[SELECT]") }
+                     .map { |line| line[/\((\d+) /, 1].to_i }
+
+    expect(selected).to eq((1..400).to_a + [300])
+    expect(result).to include("> [COUNT] (100)")
+  end
+
+  it 'LSM engine compacts runs by size tier, not all into one' do
+    script = (1..1200).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script << ".exit"
+    run_script(script, "--engine lsm")
+
+    result = run_script([".btree", "select count(*)", ".exit"])
+    runs = result.select { |line| line.start_with?("- run ") }
+                 .map { |line| line[/rows (\d+)/, 1].to_i }
+
+    expect(result).to include("> [COUNT] (1200)")
+    expect(runs.sum).to eq(1200)
+    # a memtable holds 52 rows with 4K pages, the larger runs are left alone
+    # until there are as many of them
+    expect(runs.count { |rows| rows > 52 } >= 2).to eq(true)
+    expect(runs.size <= 10).to eq(true)
+  end
+
+  it 'Committed transactions are kept, rolled back ones are discarded' do
+    script = ["insert 1 user1 user1@email.com", "begin"]
+    script += (2..60).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script += ["commit", "begin"]
+    script += (61..120).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script += ["rollback", "commit", "begin", "insert 500 user500 user500@email.com", ".exit"]
+
+    result = run_script(script)
+    expect(result).to include("> Transaction committed.")
+    expect(result).to include("> [ERROR] No transaction is open")
+    expect(result).to include("> Transaction rolled back.")
+    # the transaction still open at exit is rolled back
+    expect(result.last).to eq("Transaction rolled back.")
+
+    result = run_script([
+      "select count(*)",
+      "select count(*) where id between 61 and 500",
+      ".exit",
+    ])
+    expect(result).to include("> [COUNT] (60)")
+    expect(result).to include("> [COUNT] (0)")
+  end
+
+  it 'LSM engine rolls back rows already written out of the memtable' do
+    script = (1..30).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script << "begin"
+    script += (31..200).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script += ["rollback", "insert 31 user31 user31@email.com", "select count(*)", ".exit"]
+
+    result = run_script(script, "--engine lsm")
+    expect(result).to include("> [COUNT] (31)")
+  end
+
+  it 'LSM engine fills the whole table inside one transaction' do
+    # 1287 rows fit with 4K pages, the runs are compacted during the transaction
+    script = ["begin"]
+    script += (1..1287).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script += ["commit", "select count(*)", ".exit"]
+
+    result = run_script(script, "--engine lsm")
+    expect(result.none? { |line| line.include?("[ERROR]") }).to eq(true)
+    expect(result).to include("> [COUNT] (1287)")
+
+    # small commits are folded into one run rather than leaving a run each
+    clean_db_file()
+    script = (1..40).flat_map { |i| ["begin", "insert #{i} user#{i} user#{i}@email.com", "commit"] }
+    script += [".btree", ".exit"]
+
+    result = run_script(script, "--engine lsm")
+    expect(result.count { |line| line.start_with?("- run ") }).to eq(1)
+  end
+
+  it 'Journal left behind is rolled back, unless its header is invalid' do
+    run_script((1..20).map { |i| "insert #{i} user#{i} user#{i}@email.com" } + [".exit"])
+    file_length = File.size("testdb.db")
+    journal = lambda do |page_size, num_pages|
+      File.binwrite("testdb.db-journal", "flatDB journal1\0" + [page_size, num_pages, file_length].pack("VVQ<"))
+    end
+
+    # a page size no commit writes, the journal is not from a commit
+    journal.call(12345, 1000000)
+    result = run_script(["select count(*)", ".exit"], "2>&1")
+    expect(result).to include("[WRN] Ignoring invalid journal: testdb.db-journal")
+    expect(result).to include("> [COUNT] (20)")
+    expect(File.exist?("testdb.db-journal")).to eq(false)
+
+    journal.call(4096, 0)
+    result = run_script(["select count(*)", ".exit"])
+    expect(result).to include("[WRN] Rolled back an interrupted commit from testdb.db-journal")
+    expect(result).to include("> [COUNT] (20)")
+    expect(File.exist?("testdb.db-journal")).to eq(false)
+  end
+
+  it 'Server mode runs pipelined statements from many clients on one table' do
+    socket_path = "testdb.sock"
+    server = IO.popen("./db.exe testdb.db --serve #{socket_path}", "r")
+    sleep 0.1 until File.exist?(socket_path)
+
+    clients = (0...4).map do |c|
+      Thread.new do
+        socket = UNIXSocket.new(socket_path)
+        ids = (1..25).map { |i| c * 25 + i }
+        socket.write(ids.map { |i| "insert #{i} user#{i} user#{i}@email.com\n" }.join + ".exit\n")
+        socket.read
+      end
+    end
+
+    # every statement gets its own response, ended by an empty line
+    clients.map(&:value).each do |responses|
+      expect(responses.split("\n\n")).to eq(["Row inserted successfully."] * 25)
+    end
+
+    socket = UNIXSocket.new(socket_path)
+    socket.write("select count(*)\nselect where id between 50 and 51\n.exit\n")
+    expect(socket.read).to eq("[COUNT] (100)\n\n" +
+      "[SELECT] (50 user50 user50@email.com)\n[SELECT] (51 user51 user51@email.com)\nReturned 2 rows.\n\n")
+
+    Process.kill("TERM", server.pid)
+    server.close
+    expect(File.exist?(socket_path)).to eq(false)
+
+    result = run_script(["select count(*)", ".exit"])
+    expect(result).to include("> [COUNT] (100)")
+  end
+
+  it 'Server mode locks meta commands out of another session\'s transaction' do
+    socket_path = "testdb.sock"
+    server = IO.popen("./db.exe testdb.db --serve #{socket_path}", "r")
+    sleep 0.1 until File.exist?(socket_path)
+
+    owner = UNIXSocket.new(socket_path)
+    owner.write("begin\ninsert 1 user1 user1@email.com\n")
+    2.times { owner.gets("\n\n") }
+
+    other = UNIXSocket.new(socket_path)
+    other.write(".btree\n.backup testdb.bak\n")
+    expect(other.gets("\n\n")).to eq("[ERROR] Database is locked by another session's transaction\n\n")
+    expect(other.gets("\n\n")).to eq("[ERROR] Database is locked by another session's transaction\n\n")
+
+    owner.write("commit\n.exit\n")
+    owner.read
+
+    # backups started together from many sessions run one after the other
+    clients = (0...4).map do
+      Thread.new do
+        socket = UNIXSocket.new(socket_path)
+        socket.write(".backup testdb.bak\n.exit\n")
+        socket.read
+      end
+    end
+    clients.map(&:value).each do |response|
+      expect(response).to eq("Backup started: testdb.bak\n\n")
+    end
+
+    other.write(".exit\n")
+    other.read
+    Process.kill("TERM", server.pid)
+    server.close
+
+    result = run_script(["select count(*)", ".exit"], "", "testdb.bak")
+    expect(result).to include("> [COUNT] (1)")
+    clean_db_file("testdb.bak")
+  end
+
+  it 'Selects read a consistent snapshot while other clients insert' do
+    ["btree", "lsm"].each do |engine|
+      socket_path = "testdb.sock"
+      server = IO.popen("./db.exe testdb.db --serve #{socket_path} --engine #{engine}", "r")
+      sleep 0.1 until File.exist?(socket_path)
+
+      writer = Thread.new do
+        socket = UNIXSocket.new(socket_path)
+        socket.write((1..600).map { |i| "insert #{i} user#{i} user#{i}@email.com\n" }.join + ".exit\n")
+        socket.read
+      end
+
+      reader = UNIXSocket.new(socket_path)
+      reader.write("select\n" * 20 + ".exit\n")
+      responses = reader.read.split("\n\n")
+      writer.join
+
+      # every select sees the rows inserted before it started, and only those
+      expect(responses.size).to eq(20)
+      responses.each do |response|
+        lines = response.split("\n")
+        ids = lines[0...-1].map { |line| line[/\[SELECT\] \((\d+) /, 1].to_i }
+        expect(ids).to eq((1..ids.size).to_a)
+        expect(lines.last).to eq("Returned #{ids.size} rows.")
+      end
+
+      Process.kill("TERM", server.pid)
+      server.close
+      clean_db_file()
+    end
+  end
+
+  it 'Compressed database keeps the same rows in a fraction of the space' do
+    script = (1..300).map { |i| "insert #{i} user#{i} user#{i}@example.com" }
+    script << ".exit"
+
+    run_script(script)
+    plain_size = File.size("testdb.db")
+    clean_db_file()
+
+    run_script(script, "--compress")
+    expect(File.size("testdb.db") < plain_size / 4).to eq(true)
+
+    # compression is stored in the file, it is not needed on reopen
+    result = run_script([
+      "insert 301 user301 user301@example.com",
+      "select count(*)",
+      "select limit 2 offset 150",
+      ".exit",
+    ])
+    expect(result).to include("> [COUNT] (301)")
+    expect(result).to include("> [SELECT] (151 user151 user151@example.com)")
+    expect(result).to include("[SELECT] (152 user152 user152@example.com)")
+  end
+
+  it 'Compressed pages follow the LZ4 end of block rules' do
+    # the free space at the end of a page is zeros, a match running to the end
+    # of the page breaks the rules and the page does not read back
+    ["4K", "64K"].each do |page_size|
+      script = (1..150).map { |i| "insert #{i} user#{i} user#{i}@example.com" }
+      script << ".exit"
+      run_script(script, "--compress --page-size #{page_size}")
+
+      result = run_script(["select count(*)", "select where id between 149 and 150", ".exit"])
+      expect(result).to include("> [COUNT] (150)")
+      expect(result).to include("> [SELECT] (149 user149 user149@example.com)")
+      clean_db_file()
+    end
+  end
+
+  it 'Replay latency percentiles use the nearest rank' do
+    rows = (1..1000).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    run_script(rows + [".exit"])
+
+    # 99 quick inputs and a single slow one: the slow one is the max, and only the max
+    script = ["select count(*)"] * 99 + ["select", ".exit"]
+    run_script(script, "--record testdb.trace")
+
+    clean_db_file("replay.db")
+    run_script(rows + [".exit"], "", "replay.db")
+    result = run_script([], "--replay testdb.trace", "replay.db")
+
+    latency = result.find { |line| line.start_with?("Latency (us): ") }
+    p99 = latency[/p99 ([\d.]+)/, 1].to_f
+    max = latency[/max ([\d.]+)/, 1].to_f
+    expect(p99 * 10 < max).to eq(true)
+
+    clean_db_file("replay.db")
+    clean_db_file("testdb.trace")
+  end
+
+  it 'Recorded workload replays into a new database with the same result' do
+    script = (1..50).map { |i| "insert #{i} user#{i} user#{i}@email.com" }
+    script += ["insert 7 user7 user7@email.com", "insert 8", "delete from", ".nope", "select count(*)", ".exit"]
+    run_script(script, "--record testdb.trace")
+
+    clean_db_file("replay.db")
+    result = run_script([], "--replay testdb.trace", "replay.db")
+    summary = result.find { |line| line.start_with?("Replayed ") }
+    expect(summary).to start_with("Replayed 55 inputs from testdb.trace in ")
+    # the duplicate id fails again, and so do the inputs that never reach the table
+    expect(summary).to include("errors: 4")
+    expect(result.any? { |line| line.start_with?("Latency (us): p50 ") }).to eq(true)
+    expect(result.any? { |line| line.start_with?("  insert: 52 inputs, p50 ") }).to eq(true)
+    expect(result.any? { |line| line.start_with?("Pager: page hits ") }).to eq(true)
+
+    result = run_script(["select count(*)", ".exit"], "", "replay.db")
+    expect(result).to include("> [COUNT] (50)")
+
+    # a replay is not recorded, and only a replay can be paced
+    result = run_script([], "--replay testdb.trace --record replay.trace 2>&1", "replay.db")
+    expect(result).to include("--replay and --record cannot be used together")
+    result = run_script([".exit"], "--paced 2>&1", "replay.db")
+    expect(result).to include("--paced needs --replay")
+    expect(File.exist?("replay.trace")).to eq(false)
+
+    clean_db_file("replay.db")
+    clean_db_file("testdb.trace")
+  end
 end
-  
\ No newline at end of file